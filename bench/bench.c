@@ -0,0 +1,450 @@
+/** @file
+ * Microbenchmarks of the thread-pool and the futures.
+ *
+ * Every result is printed to the standard output as a single JSON object
+ * per line, so runs of different versions can be compared with any script.
+ * Usage: bench [max_threads [repeats [tasks]]].
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/future/future.h"
+
+/**
+ * Number of async+await round trips measured for the latency percentiles.
+ */
+#define LATENCY_ROUNDS 20000
+
+/**
+ * Number of round trips run before measuring.
+ */
+#define WARMUP_ROUNDS 1000
+
+/**
+ * Number of bursts measured for the burst latency.
+ */
+#define BURST_ROUNDS 2000
+
+/**
+ * Number of tasks deferred together in a burst.
+ */
+#define BURST_TASKS 4
+
+/**
+ * Pause between two bursts in nanoseconds, the threads go idle in it.
+ */
+#define BURST_GAP_NS 50000
+
+/**
+ * What idle threads of the measured pool do before parking.
+ */
+typedef struct idle_policy {
+    const char* name; ///<               name in the results;
+    size_t spin_count; ///<   options.spin_count of the pool;
+    size_t yield_count; ///< options.yield_count of the pool;
+} idle_policy_t;
+
+static const idle_policy_t idle_policies[] = {
+    {"park", 0, 0},
+    {"spin", 4096, 0},
+    {"spin_yield", 4096, 4},
+};
+static const int idle_policies_count = sizeof(idle_policies) / sizeof(idle_policies[0]);
+
+static const char* mode_names[] = {"shared", "stealing", "ring", "sharded"};
+static const int modes_count = sizeof(mode_names) / sizeof(mode_names[0]);
+static const size_t chain_depths[] = {1, 16, 256, 4096};
+static const size_t fan_widths[] = {16, 256, 4096};
+
+/** @brief Read the monotonic clock.
+ * @return Number of nanoseconds from an unspecified point.
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/** @brief Compare two samples for qsort.
+ * @param[in] a – first sample;
+ * @param[in] b – second sample;
+ * @return Negative, zero or positive value like strcmp.
+ */
+static int compare_samples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Sort the samples and pick a percentile.
+ * @param[in,out] samples – measured values, sorted by the call;
+ * @param[in] count       –             number of samples;
+ * @param[in] percentile  –     percentile from [0, 100];
+ * @return Value of the percentile.
+ */
+static uint64_t percentile(uint64_t* samples, size_t count, double percentile) {
+    qsort(samples, count, sizeof(uint64_t), compare_samples);
+    size_t index = (size_t) (percentile / 100.0 * (double) (count - 1) + 0.5);
+    return samples[index];
+}
+
+/** @brief Start a pool for the benchmarks.
+ * @param[out] pool    – pointer to the pool;
+ * @param[in] mode     –   scheduling mode;
+ * @param[in] threads  – number of threads;
+ * @param[in] idle     – what idle threads do;
+ */
+static void start_pool(thread_pool_t* pool, thread_pool_mode_t mode, size_t threads,
+                       const idle_policy_t* idle) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, threads);
+    options.mode = mode;
+    options.capacity = 1 << 16;
+    options.spin_count = idle->spin_count;
+    options.yield_count = idle->yield_count;
+    if (thread_pool_init_with(pool, &options) != 0) {
+        fprintf(stderr, "ERROR: thread_pool_init failed\n");
+        exit(-1);
+    }
+}
+
+/**
+ * State of the throughput benchmark, shared by the producers and the tasks.
+ */
+typedef struct throughput {
+    thread_pool_t* pool; ///<                     measured pool;
+    size_t per_producer; ///< tasks deferred by every producer;
+    pthread_barrier_t ready; ///< released when every producer is running;
+    pthread_barrier_t start; ///<   released after the clock is read;
+    atomic_size_t left; ///<           tasks that did not run yet;
+    sem_t done; ///<                  posted by the last task;
+} throughput_t;
+
+/** @brief Empty task of the throughput benchmark.
+ * @param[in,out] args – benchmark state;
+ * @param[in] argsz    – unused;
+ */
+static void empty_task(void* args, size_t argsz __attribute__((unused))) {
+    throughput_t* state = args;
+    if (atomic_fetch_sub_explicit(&state->left, 1, memory_order_relaxed) == 1) {
+        sem_post(&state->done);
+    }
+}
+
+/** @brief Defer the share of a producer, one task at a time.
+ * A full ring rejects the task, then the producer retries.
+ * @param[in,out] arg – benchmark state;
+ * @return @p NULL.
+ */
+static void* producer(void* arg) {
+    throughput_t* state = arg;
+    runnable_t task = {.function = empty_task, .arg = state, .argsz = 0};
+    pthread_barrier_wait(&state->ready);
+    pthread_barrier_wait(&state->start);
+    for (size_t i = 0; i < state->per_producer; ++i) {
+        while (defer(state->pool, task) != 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/** @brief Measure how fast producers defer empty tasks and consumers run them.
+ * @param[in] mode      –     scheduling mode;
+ * @param[in] producers – number of deferring threads;
+ * @param[in] consumers –   number of pool threads;
+ * @param[in] tasks     –  number of tasks in a run;
+ * @param[in] repeats   –          number of runs;
+ */
+static void bench_throughput(thread_pool_mode_t mode, size_t producers, size_t consumers,
+                             size_t tasks, size_t repeats) {
+    uint64_t* samples = malloc(repeats * sizeof(uint64_t));
+    pthread_t* threads = malloc(producers * sizeof(pthread_t));
+    for (size_t run = 0; run < repeats; ++run) {
+        thread_pool_t pool;
+        start_pool(&pool, mode, consumers, &idle_policies[0]);
+        throughput_t state = {.pool = &pool, .per_producer = tasks / producers};
+        atomic_init(&state.left, state.per_producer * producers);
+        pthread_barrier_init(&state.ready, NULL, producers + 1);
+        pthread_barrier_init(&state.start, NULL, producers + 1);
+        sem_init(&state.done, 0, 0);
+        for (size_t i = 0; i < producers; ++i) {
+            pthread_create(&threads[i], NULL, producer, &state);
+        }
+
+        // The clock is read before any producer is released.
+        pthread_barrier_wait(&state.ready);
+        uint64_t start = now_ns();
+        pthread_barrier_wait(&state.start);
+        sem_wait(&state.done);
+        samples[run] = now_ns() - start;
+
+        for (size_t i = 0; i < producers; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        thread_pool_destroy(&pool);
+        pthread_barrier_destroy(&state.ready);
+        pthread_barrier_destroy(&state.start);
+        sem_destroy(&state.done);
+    }
+    size_t total = tasks / producers * producers;
+    uint64_t median = percentile(samples, repeats, 50);
+    uint64_t fastest = percentile(samples, repeats, 0);
+    printf("{\"benchmark\": \"defer_throughput\", \"mode\": \"%s\", \"producers\": %zu, "
+           "\"consumers\": %zu, \"tasks\": %zu, \"ns_per_task\": %.2f, "
+           "\"min_ns_per_task\": %.2f, \"tasks_per_sec\": %.0f}\n",
+           mode_names[mode], producers, consumers, total, (double) median / total,
+           (double) fastest / total, total * 1e9 / median);
+    free(threads);
+    free(samples);
+}
+
+/** @brief Callable returning its argument.
+ * @param[in] arg          – argument of the callable;
+ * @param[in] argsz        –      size of the argument;
+ * @param[out] result_size –        size of the result;
+ * @return @p arg.
+ */
+static void* identity(void* arg, size_t argsz, size_t* result_size) {
+    *result_size = argsz;
+    return arg;
+}
+
+/** @brief Measure the latency of async followed by await.
+ * @param[in] mode    – scheduling mode;
+ * @param[in] threads – number of pool threads;
+ * @param[in] idle    – what idle threads do;
+ */
+static void bench_latency(thread_pool_mode_t mode, size_t threads, const idle_policy_t* idle) {
+    thread_pool_t pool;
+    start_pool(&pool, mode, threads, idle);
+    uint64_t* samples = malloc(LATENCY_ROUNDS * sizeof(uint64_t));
+    callable_t callable = {.function = identity, .arg = NULL, .argsz = 0};
+    future_t future;
+    for (size_t i = 0; i < WARMUP_ROUNDS + LATENCY_ROUNDS; ++i) {
+        uint64_t start = now_ns();
+        async(&pool, &future, callable);
+        await(&future);
+        if (i >= WARMUP_ROUNDS) {
+            samples[i - WARMUP_ROUNDS] = now_ns() - start;
+        }
+    }
+    thread_pool_destroy(&pool);
+
+    unsigned long p50 = percentile(samples, LATENCY_ROUNDS, 50);
+    unsigned long p90 = percentile(samples, LATENCY_ROUNDS, 90);
+    unsigned long p99 = percentile(samples, LATENCY_ROUNDS, 99);
+    unsigned long p999 = percentile(samples, LATENCY_ROUNDS, 99.9);
+    unsigned long max = percentile(samples, LATENCY_ROUNDS, 100);
+    printf("{\"benchmark\": \"async_await_latency\", \"mode\": \"%s\", \"idle\": \"%s\", "
+           "\"threads\": %zu, \"rounds\": %d, \"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, "
+           "\"p999_ns\": %lu, \"max_ns\": %lu}\n",
+           mode_names[mode], idle->name, threads, LATENCY_ROUNDS, p50, p90, p99, p999, max);
+    free(samples);
+}
+
+/**
+ * State of the burst latency benchmark, shared by the main thread and the tasks.
+ */
+typedef struct burst {
+    uint64_t deferred; ///<    time the current burst was deferred;
+    uint64_t* samples; ///< time from the burst to the start of a task;
+    atomic_size_t taken; ///<          number of written samples;
+    atomic_size_t left; ///<   tasks of the burst that did not run yet;
+    sem_t done; ///<               posted by the last task of the burst;
+} burst_t;
+
+/** @brief Task of the burst benchmark, records when it started.
+ * @param[in,out] args – benchmark state;
+ * @param[in] argsz    – unused;
+ */
+static void burst_task(void* args, size_t argsz __attribute__((unused))) {
+    burst_t* state = args;
+    uint64_t start = now_ns();
+    state->samples[atomic_fetch_add(&state->taken, 1)] = start - state->deferred;
+    if (atomic_fetch_sub(&state->left, 1) == 1) {
+        sem_post(&state->done);
+    }
+}
+
+/** @brief Measure how fast idle threads start sparse bursts of defers.
+ * Between the bursts the threads have nothing to do for BURST_GAP_NS,
+ * so they spin or park depending on the idle policy.
+ * @param[in] threads – number of pool threads;
+ * @param[in] idle    – what idle threads do;
+ */
+static void bench_burst(size_t threads, const idle_policy_t* idle) {
+    thread_pool_t pool;
+    start_pool(&pool, THREAD_POOL_SHARED_QUEUE, threads, idle);
+    size_t count = BURST_ROUNDS * BURST_TASKS;
+    burst_t state = {.samples = malloc(count * sizeof(uint64_t))};
+    atomic_init(&state.taken, 0);
+    sem_init(&state.done, 0, 0);
+    runnable_t task = {.function = burst_task, .arg = &state, .argsz = 0};
+    struct timespec gap = {.tv_sec = 0, .tv_nsec = BURST_GAP_NS};
+    for (size_t round = 0; round < BURST_ROUNDS; ++round) {
+        nanosleep(&gap, NULL);
+        atomic_store(&state.left, BURST_TASKS);
+        state.deferred = now_ns();
+        for (int i = 0; i < BURST_TASKS; ++i) {
+            defer(&pool, task);
+        }
+        sem_wait(&state.done);
+    }
+    thread_pool_destroy(&pool);
+
+    unsigned long p50 = percentile(state.samples, count, 50);
+    unsigned long p99 = percentile(state.samples, count, 99);
+    unsigned long max = percentile(state.samples, count, 100);
+    printf("{\"benchmark\": \"burst_latency\", \"idle\": \"%s\", \"threads\": %zu, "
+           "\"bursts\": %d, \"burst_tasks\": %d, \"gap_ns\": %d, \"p50_ns\": %lu, "
+           "\"p99_ns\": %lu, \"max_ns\": %lu}\n",
+           idle->name, threads, BURST_ROUNDS, BURST_TASKS, BURST_GAP_NS, p50, p99, max);
+    sem_destroy(&state.done);
+    free(state.samples);
+}
+
+/** @brief Measure a chain of maps started from a finished future.
+ * Every link becomes runnable only when the previous one is finished.
+ * @param[in] threads – number of pool threads;
+ * @param[in] depth   –   number of maps in the chain;
+ * @param[in] repeats –          number of runs;
+ */
+static void bench_map_chain(size_t threads, size_t depth, size_t repeats) {
+    thread_pool_t pool;
+    start_pool(&pool, THREAD_POOL_SHARED_QUEUE, threads, &idle_policies[0]);
+    future_t* futures = malloc((depth + 1) * sizeof(future_t));
+    uint64_t* samples = malloc(repeats * sizeof(uint64_t));
+    for (size_t run = 0; run < repeats; ++run) {
+        uint64_t start = now_ns();
+        future_init_ready(&futures[0], NULL, 0);
+        for (size_t i = 1; i <= depth; ++i) {
+            map(&pool, &futures[i], &futures[i - 1], identity);
+        }
+        await(&futures[depth]);
+        samples[run] = now_ns() - start;
+    }
+    thread_pool_destroy(&pool);
+
+    uint64_t median = percentile(samples, repeats, 50);
+    printf("{\"benchmark\": \"map_chain\", \"threads\": %zu, \"depth\": %zu, "
+           "\"ns\": %lu, \"ns_per_link\": %.2f}\n",
+           threads, depth, (unsigned long) median, (double) median / depth);
+    free(samples);
+    free(futures);
+}
+
+/** @brief Measure async of many tasks joined by when_all.
+ * @param[in] mode    –  scheduling mode;
+ * @param[in] threads – number of pool threads;
+ * @param[in] width   –     number of tasks;
+ * @param[in] repeats –     number of runs;
+ */
+static void bench_fan_out(thread_pool_mode_t mode, size_t threads, size_t width,
+                          size_t repeats) {
+    thread_pool_t pool;
+    start_pool(&pool, mode, threads, &idle_policies[0]);
+    future_t* futures = malloc(width * sizeof(future_t));
+    future_t** inputs = malloc(width * sizeof(future_t*));
+    callable_t* callables = malloc(width * sizeof(callable_t));
+    for (size_t i = 0; i < width; ++i) {
+        inputs[i] = &futures[i];
+        callables[i] = (callable_t) {.function = identity, .arg = NULL, .argsz = 0};
+    }
+    uint64_t* samples = malloc(repeats * sizeof(uint64_t));
+    for (size_t run = 0; run < repeats; ++run) {
+        future_t all;
+        uint64_t start = now_ns();
+        async_batch(&pool, futures, callables, width);
+        when_all(&pool, &all, inputs, width);
+        await(&all);
+        samples[run] = now_ns() - start;
+    }
+    thread_pool_destroy(&pool);
+
+    uint64_t median = percentile(samples, repeats, 50);
+    printf("{\"benchmark\": \"fan_out_fan_in\", \"mode\": \"%s\", \"threads\": %zu, "
+           "\"width\": %zu, \"ns\": %lu, \"ns_per_task\": %.2f}\n",
+           mode_names[mode], threads, width, (unsigned long) median, (double) median / width);
+    free(samples);
+    free(callables);
+    free(inputs);
+    free(futures);
+}
+
+/** @brief Fill the thread counts: powers of two up to the maximum, and the maximum.
+ * @param[out] counts     – array of at least 64 counts;
+ * @param[in] max_threads –        the largest count;
+ * @return Number of the counts.
+ */
+static size_t thread_counts(size_t* counts, size_t max_threads) {
+    size_t count = 0;
+    for (size_t threads = 1; threads < max_threads; threads *= 2) {
+        counts[count++] = threads;
+    }
+    counts[count++] = max_threads;
+    return count;
+}
+
+int main(int argc, char** argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t) cpus;
+    size_t repeats = argc > 2 ? strtoul(argv[2], NULL, 10) : 5;
+    size_t tasks = argc > 3 ? strtoul(argv[3], NULL, 10) : 1 << 18;
+    if (max_threads == 0 || repeats == 0 || tasks == 0) {
+        fprintf(stderr, "usage: %s [max_threads [repeats [tasks]]]\n", argv[0]);
+        return -1;
+    }
+#ifdef __OPTIMIZE__
+    const char* optimized = "true";
+#else
+    const char* optimized = "false";
+#endif
+    printf("{\"benchmark\": \"config\", \"cpus\": %ld, \"max_threads\": %zu, \"repeats\": %zu, "
+           "\"tasks\": %zu, \"optimized\": %s}\n",
+           cpus, max_threads, repeats, tasks, optimized);
+
+    size_t counts[64];
+    size_t counts_size = thread_counts(counts, max_threads);
+    for (int mode = 0; mode < modes_count; ++mode) {
+        for (size_t p = 0; p < counts_size; ++p) {
+            for (size_t c = 0; c < counts_size; ++c) {
+                bench_throughput(mode, counts[p], counts[c], tasks, repeats);
+                fflush(stdout);
+            }
+        }
+    }
+    for (int mode = 0; mode < modes_count; ++mode) {
+        for (size_t c = 0; c < counts_size; ++c) {
+            bench_latency(mode, counts[c], &idle_policies[0]);
+            fflush(stdout);
+        }
+    }
+    // Parking at once against spinning before parking.
+    for (int idle = 0; idle < idle_policies_count; ++idle) {
+        for (size_t c = 0; c < counts_size; ++c) {
+            bench_latency(THREAD_POOL_SHARED_QUEUE, counts[c], &idle_policies[idle]);
+            bench_burst(counts[c], &idle_policies[idle]);
+            fflush(stdout);
+        }
+    }
+    for (size_t i = 0; i < sizeof(chain_depths) / sizeof(chain_depths[0]); ++i) {
+        bench_map_chain(max_threads, chain_depths[i], repeats);
+    }
+    for (int mode = 0; mode < modes_count; ++mode) {
+        for (size_t i = 0; i < sizeof(fan_widths) / sizeof(fan_widths[0]); ++i) {
+            bench_fan_out(mode, max_threads, fan_widths[i], repeats);
+        }
+    }
+    return 0;
+}
@@ -53,9 +53,7 @@ int32_t main() {
             return -1;
         }
         *k = i + 1;
-        future[i]->result = k;
-        future[i]->result_size = sizeof(uint64_t);
-        sem_init(&future[i]->finished, 0, 1);
+        future_init_ready(future[i], k, sizeof(uint64_t));
     }
 
     for (uint32_t i = 3; i < n; ++i) {
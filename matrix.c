@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <unistd.h>
 
 #include "src/threadpool/threadpool.h"
 
@@ -14,11 +13,9 @@ uint64_t* result;
 
 static void fun(void* arg, size_t size __attribute__((unused))) {
     value_time_row_t* context = arg;
-    usleep(context->t * 1000);
     sem_wait(&guard[context->r]);
     result[context->r] += context->v;
     sem_post(&guard[context->r]);
-    free(context);
 }
 
 int32_t main() {
@@ -52,24 +49,32 @@ int32_t main() {
         return err;
     }
 
+    value_time_row_t* cells = malloc(k * n * sizeof(value_time_row_t));
+    if (cells == NULL) {
+        fprintf(stderr, "ERROR: malloc has failed\n");
+        return -1;
+    }
+
     for (uint32_t i = 0; i < k * n; ++i) {
         uint32_t v, t;
         scanf("%u%u", &v, &t);
 
-        value_time_row_t* context = malloc(sizeof(value_time_row_t));
+        value_time_row_t* context = &cells[i];
         context->v = v;
         context->t = t;
         context->r = i / n;
 
-        runnable_t r;
-        r.function = fun;
-        r.arg = context;
-        r.argsz = sizeof(value_time_row_t);
-
-        defer(pool, r);
+        // The cell waits in the timer wheel, not on a thread. The wheel keeps
+        // only the runnable, so the cells live in one array until destroy.
+        runnable_t task = {.function = fun, .arg = context, .argsz = sizeof(value_time_row_t)};
+        if ((err = defer_after(pool, task, (uint64_t) t * 1000000)) != 0) {
+            fprintf(stderr, "ERROR: defer_after failed with %d\n", err);
+            return err;
+        }
     }
 
     thread_pool_destroy(pool);
+    free(cells);
 
     for (uint32_t i = 0; i < k; ++i) {
         printf("%lu\n", result[i]);
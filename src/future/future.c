@@ -6,100 +6,467 @@
  * @date 11.02.2020
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "future.h"
+#include "../threadpool/futex.h"
+
+#include <limits.h>
 
 typedef void *(*function_t)(void *);
 
 /**
- * Pair of future variables.
+ * Number of runnables async_batch builds on the stack.
+ */
+#define ASYNC_BATCH_BUFFER 64
+
+/**
+ * Marker stored in the list of continuations of a finished future.
  */
-typedef struct pair_future {
-    future_t* first; ///<   pointer to first future;
-    future_t* second; ///< pointer to second future;
-} pair_future_t;
+static continuation_t completed_marker;
+
+/**
+ * List of continuations of a finished future.
+ */
+#define COMPLETED (&completed_marker)
+
+/** @brief Prepare the future to be computed.
+ * @param[out] future  – pointer to the future;
+ * @param[in] pool     – pool the future is computed on;
+ * @param[in] callable –          callable function;
+ * @return @p 0, if future was initialized correctly.
+ * Non-zero value, if errors occurred.
+ */
+static int future_init(future_t* future, thread_pool_t* pool, callable_t callable) {
+    future->callable = callable;
+    future->pool = pool;
+    atomic_init(&future->continuations, NULL);
+    atomic_init(&future->state, FUTURE_PENDING);
+    cancel_token_init(&future->cancel);
+    return 0;
+}
+
+/** @brief Check if cancellation of the unfinished future was requested.
+ * @param[in] future – pointer to the future;
+ * @return @p true, if future_cancel or the token of its callable cancelled it.
+ */
+static bool cancelling(const future_t* future) {
+    return cancel_requested(&future->cancel) || cancel_requested(future->callable.token);
+}
+
+/** @brief Finish the future and run its continuations.
+ * The result has to be written before. All sleeping awaiters are woken
+ * at once, the futex is called only if somebody sleeps.
+ * The continuations run after the state is set and get the future
+ * (when_all reads its state, map its result), so the future has to outlive
+ * them: it can be freed only after the futures depending on it are finished,
+ * not as soon as await returns.
+ * @param[in,out] future  – pointer to the future;
+ * @param[in] cancelled   – information if an input of the future was cancelled;
+ */
+static void complete(future_t* future, bool cancelled) {
+    future_state_t state = cancelled || cancelling(future) ? FUTURE_CANCELLED : FUTURE_READY;
+    continuation_t* continuation = atomic_exchange(&future->continuations, COMPLETED);
+    if (atomic_exchange(&future->state, state) == FUTURE_WAITED) {
+        futex_wake(&future->state, INT_MAX);
+    }
+    while (continuation != NULL) {
+        continuation_t* next = continuation->next;
+        continuation->function(continuation, future);
+        continuation = next;
+    }
+}
+
+static int wait_ready(future_t* future, const struct timespec* deadline);
+
+/** @brief Register the continuation of the future.
+ * complete takes the list before it sets the final state, so a future
+ * without the list may still look unfinished for a moment; the caller
+ * reads its state, so it is waited for.
+ * @param[in,out] future       –          pointer to the future;
+ * @param[in,out] continuation – continuation to be registered;
+ * @return @p true, if the continuation will be run by complete,
+ * @p false if the future is already finished (in its final state).
+ */
+static bool add_continuation(future_t* future, continuation_t* continuation) {
+    continuation_t* head = atomic_load(&future->continuations);
+    do {
+        if (head == COMPLETED) {
+            wait_ready(future, NULL);
+            return false;
+        }
+        continuation->next = head;
+    } while (!atomic_compare_exchange_weak(&future->continuations, &head, continuation));
+    return true;
+}
 
 /** @brief Wrap callable function in runnable.
  * Write the result of the function to variable.
- * Unlock the semaphore to let user know that the task is finished.
+ * Finish the future to let user know that the task is finished.
  * @param[in,out] arg –  array of arguments;
  */
 static void fun(void* arg, size_t size __attribute__((unused))) {
     future_t* f = arg;
-    f->result = f->callable.function(f->callable.arg, f->callable.argsz, &f->result_size);
-    sem_post(&f->finished);
+    if (cancelling(f)) {
+        f->result = NULL;
+        f->result_size = 0;
+    } else {
+        f->result = f->callable.function(f->callable.arg, f->callable.argsz, &f->result_size);
+    }
+    complete(f, false);
 }
 
 /** @brief Helper function for map.
- * Wait until from is finished, then run the function and write the result to future.
- * @param[in,out] arg – array of arguments;
+ * Run the function on the result of the finished source future
+ * and write the result to the mapped future.
+ * The source future is kept in callable.arg of the mapped one,
+ * so map does not allocate.
+ * @param[in,out] arg – mapped future;
+ */
+static void fun_mapped(void* arg, size_t size __attribute__((unused))) {
+    future_t* to = arg;
+    future_t* from = to->callable.arg;
+    if (cancelling(to)) {
+        to->result = NULL;
+        to->result_size = 0;
+    } else {
+        to->result = to->callable.function(from->result, from->result_size, &to->result_size);
+    }
+    complete(to, false);
+}
+
+/** @brief Add the mapped future to its pool.
+ * A future mapped from a cancelled one is cancelled at once, without
+ * a task, so cancellation goes down the whole chain of maps.
+ * @param[in,out] to – mapped future;
+ * @return @p 0, if the task was deferred correctly.
+ * Non-zero value, if errors occurred.
  */
-static void fun_with_wait(void* arg, size_t size __attribute__((unused))) {
-    pair_future_t* pair = arg;
-    future_t* from = pair->first;
-    sem_wait(&from->finished);
-    sem_post(&from->finished);
-    future_t* to = pair->second;
-    to->result = to->callable.function(from->result, from->result_size, &to->result_size);
-    sem_post(&to->finished);
-    free(pair);
+static int schedule_mapped(future_t* to) {
+    future_t* from = to->callable.arg;
+    if (atomic_load_explicit(&from->state, memory_order_acquire) == FUTURE_CANCELLED) {
+        to->result = NULL;
+        to->result_size = 0;
+        complete(to, true);
+        return 0;
+    }
+
+    runnable_t r;
+    r.function = fun_mapped;
+    r.arg = to;
+    r.argsz = sizeof(future_t);
+    r.token = NULL;
+
+    return defer(to->pool, r);
 }
 
+/** @brief Continuation registered by map.
+ * Called when the source future is finished. If the pool rejects the task
+ * (a full ring, a destroyed pool), the function is run by the current thread,
+ * so the mapped future is always finished.
+ * @param[in,out] continuation – continuation of the mapped future;
+ * @param[in] from             –        finished source future;
+ */
+static void map_continuation(continuation_t* continuation,
+                             future_t* from __attribute__((unused))) {
+    future_t* to = (future_t*) ((char*) continuation - offsetof(future_t, continuation));
+    if (schedule_mapped(to) != 0) {
+        fun_mapped(to, sizeof(future_t));
+    }
+}
 
 int async(thread_pool_t *pool, future_t *future, callable_t callable) {
-    future->callable = callable;
-    int err = sem_init(&future->finished, 1, 0);
+    int err = future_init(future, pool, callable);
     if (err != 0) {
-        fprintf(stderr, "ERROR: sem_init failed\n");
-        return -1;
+        return err;
     }
 
     runnable_t r;
     r.function = fun;
     r.arg = future;
     r.argsz = sizeof(future_t);
+    r.token = NULL;
 
-    defer(pool, r);
+    return defer(pool, r);
+}
 
-    return 0;
+int async_batch(thread_pool_t* pool, future_t* futures, const callable_t* callables,
+                size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    int err = 0;
+    for (size_t i = 0; i < count && err == 0; ++i) {
+        err = future_init(&futures[i], pool, callables[i]);
+    }
+    if (err != 0) {
+        return err;
+    }
+
+    runnable_t buffer[ASYNC_BATCH_BUFFER];
+    runnable_t* runnables = buffer;
+    size_t deferred = 0;
+    if (count > ASYNC_BATCH_BUFFER) {
+        runnables = malloc(count * sizeof(runnable_t));
+        if (runnables == NULL) {
+            fprintf(stderr, "ERROR: runnables malloc failed\n");
+            err = -1;
+        }
+    }
+
+    if (err == 0) {
+        for (size_t i = 0; i < count; ++i) {
+            runnables[i].function = fun;
+            runnables[i].arg = &futures[i];
+            runnables[i].argsz = sizeof(future_t);
+            runnables[i].token = NULL;
+        }
+        err = defer_batch_counted(pool, runnables, count, &deferred);
+        if (runnables != buffer) {
+            free(runnables);
+        }
+    }
+
+    // Nothing would ever finish the futures of the tasks that were not deferred.
+    for (size_t i = deferred; i < count; ++i) {
+        futures[i].result = NULL;
+        futures[i].result_size = 0;
+        complete(&futures[i], true);
+    }
+    return err;
 }
 
 int map(thread_pool_t* pool, future_t* future, future_t* from,
         void *(*function)(void *, size_t, size_t*)) {
 
-    pair_future_t* pair = malloc(sizeof(pair_future_t));
-    if (pair == NULL) {
-        fprintf(stderr, "ERROR: callable_init failed\n");
-        return -1;
-    }
-    pair->first = from;
-    pair->second = future;
-
     callable_t callable;
     callable.function = function;
-    callable.arg = pair;
+    callable.arg = from;
+    callable.argsz = sizeof(future_t);
+    callable.token = NULL;
 
-    future->callable = callable;
-    int err = sem_init(&future->finished, 1, 0);
+    int err = future_init(future, pool, callable);
+    if (err != 0) {
+        return err;
+    }
+
+    future->continuation.function = map_continuation;
+    if (add_continuation(from, &future->continuation)) {
+        return 0;
+    }
+    return schedule_mapped(future);
+}
+
+/**
+ * Continuation registered by when_all and when_any in every input.
+ */
+typedef struct when_link {
+    continuation_t continuation; ///<  registered continuation;
+    struct when_state* state; ///< state shared by all links;
+    size_t index; ///<              index of the input future;
+} when_link_t;
+
+/**
+ * State shared by the continuations of when_all and when_any.
+ */
+typedef struct when_state {
+    atomic_size_t remaining; ///< inputs to finish (when_all), 1 until won (when_any);
+    atomic_size_t references; ///<              continuations that did not run yet;
+    atomic_bool cancelled; ///<               information if an input was cancelled;
+    future_t* out; ///<                                     combined future;
+    future_t** inputs; ///<                                  input futures;
+    size_t count; ///<                                     number of inputs;
+    when_link_t links[]; ///<                            one link per input;
+} when_state_t;
+
+/** @brief Release the reference held by a finished link.
+ * @param[in,out] state – shared state;
+ */
+static void when_release(when_state_t* state) {
+    if (atomic_fetch_sub(&state->references, 1) == 1) {
+        free(state);
+    }
+}
+
+/** @brief Continuation of when_all.
+ * The last finished input finishes the combined future,
+ * which is cancelled if any of the inputs was.
+ * @param[in,out] continuation – link of the input;
+ * @param[in] from             – finished input;
+ */
+static void when_all_continuation(continuation_t* continuation, future_t* from) {
+    when_state_t* state = ((when_link_t*) continuation)->state;
+    if (atomic_load_explicit(&from->state, memory_order_acquire) == FUTURE_CANCELLED) {
+        atomic_store(&state->cancelled, true);
+    }
+    if (atomic_fetch_sub(&state->remaining, 1) == 1) {
+        state->out->result = state->inputs;
+        state->out->result_size = state->count;
+        complete(state->out, atomic_load(&state->cancelled));
+    }
+    when_release(state);
+}
+
+/** @brief Continuation of when_any.
+ * The first finished input finishes the combined future.
+ * @param[in,out] continuation – link of the input;
+ * @param[in] from             – finished input;
+ */
+static void when_any_continuation(continuation_t* continuation, future_t* from) {
+    when_link_t* link = (when_link_t*) continuation;
+    when_state_t* state = link->state;
+    if (atomic_exchange(&state->remaining, 0) == 1) {
+        state->out->result = from;
+        state->out->result_size = link->index;
+        complete(state->out, false);
+    }
+    when_release(state);
+}
+
+/** @brief Register the continuation in every input.
+ * @param[in,out] pool   –   pool of the combined future;
+ * @param[in,out] out    –          combined future;
+ * @param[in] inputs     –      array of input futures;
+ * @param[in] count      –          number of inputs;
+ * @param[in] remaining  – initial value of the countdown;
+ * @param[in] function   –   continuation of every input;
+ * @return @p 0, if the continuations were registered correctly.
+ * Non-zero value, if errors occurred.
+ */
+static int when(thread_pool_t* pool, future_t* out, future_t** inputs, size_t count,
+                size_t remaining, void (*function)(continuation_t*, future_t*)) {
+    callable_t callable = {.function = NULL, .arg = NULL, .argsz = 0};
+    int err = future_init(out, pool, callable);
     if (err != 0) {
-        fprintf(stderr, "ERROR: sem_init failed\n");
+        return err;
+    }
+
+    when_state_t* state = malloc(sizeof(when_state_t) + count * sizeof(when_link_t));
+    if (state == NULL) {
+        fprintf(stderr, "ERROR: when state malloc failed\n");
         return -1;
     }
+    atomic_init(&state->remaining, remaining);
+    atomic_init(&state->references, count);
+    atomic_init(&state->cancelled, false);
+    state->out = out;
+    state->inputs = inputs;
+    state->count = count;
 
-    runnable_t r;
-    r.function = fun_with_wait;
-    r.arg = pair;
-    r.argsz = sizeof(pair_future_t);
+    for (size_t i = 0; i < count; ++i) {
+        when_link_t* link = &state->links[i];
+        link->continuation.function = function;
+        link->state = state;
+        link->index = i;
+        if (!add_continuation(inputs[i], &link->continuation)) {
+            function(&link->continuation, inputs[i]);
+        }
+    }
+    return 0;
+}
+
+int when_all(thread_pool_t* pool, future_t* out, future_t** inputs, size_t count) {
+    if (count == 0) {
+        callable_t callable = {.function = NULL, .arg = NULL, .argsz = 0};
+        int err = future_init(out, pool, callable);
+        if (err != 0) {
+            return err;
+        }
+        out->result = inputs;
+        out->result_size = 0;
+        complete(out, false);
+        return 0;
+    }
+    return when(pool, out, inputs, count, count, when_all_continuation);
+}
 
-    defer(pool, r);
+int when_any(thread_pool_t* pool, future_t* out, future_t** inputs, size_t count) {
+    if (count == 0) {
+        fprintf(stderr, "ERROR: when_any without inputs\n");
+        return -1;
+    }
+    return when(pool, out, inputs, count, 1, when_any_continuation);
+}
 
+int future_init_ready(future_t* future, void* result, size_t result_size) {
+    callable_t callable = {.function = NULL, .arg = NULL, .argsz = 0};
+    int err = future_init(future, NULL, callable);
+    if (err != 0) {
+        return err;
+    }
+    future->result = result;
+    future->result_size = result_size;
+    complete(future, false);
     return 0;
 }
 
-void* await(future_t* future) {
-    sem_wait(&future->finished);
-    sem_destroy(&future->finished);
+/** @brief Sleep until the future is finished or the deadline passes.
+ * Inside a task, help the pool instead of sleeping.
+ * @param[in,out] future – pointer to the future;
+ * @param[in] deadline   – absolute CLOCK_MONOTONIC time or @p NULL;
+ * @return @p 0, if the future is finished, @p ETIMEDOUT if the deadline passed.
+ */
+static int wait_ready(future_t* future, const struct timespec* deadline) {
+    int state = atomic_load_explicit(&future->state, memory_order_acquire);
+    while (state != FUTURE_READY && state != FUTURE_CANCELLED) {
+        if (state == FUTURE_PENDING
+            && !atomic_compare_exchange_weak(&future->state, &state, FUTURE_WAITED)) {
+            continue;
+        }
+        // A worker of a pool runs other tasks instead of blocking its thread.
+        int err = thread_pool_help_wait(&future->state, FUTURE_WAITED, deadline);
+        if (err < 0) {
+            err = futex_wait(&future->state, FUTURE_WAITED, deadline);
+        }
+        if (err == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+        state = atomic_load_explicit(&future->state, memory_order_acquire);
+    }
+    return 0;
+}
 
+void* await(future_t* future) {
+    wait_ready(future, NULL);
     return future->result;
 }
+
+void future_cancel(future_t* future) {
+    cancel(&future->cancel);
+}
+
+bool future_cancelled(future_t* future) {
+    return atomic_load_explicit(&future->state, memory_order_acquire) == FUTURE_CANCELLED;
+}
+
+bool future_try_get(future_t* future, void** result) {
+    int state = atomic_load_explicit(&future->state, memory_order_acquire);
+    if (state != FUTURE_READY && state != FUTURE_CANCELLED) {
+        return false;
+    }
+    *result = future->result;
+    return true;
+}
+
+int await_until(future_t* future, const struct timespec* deadline, void** result) {
+    int err = wait_ready(future, deadline);
+    if (err != 0) {
+        return err;
+    }
+    *result = future->result;
+    return future_cancelled(future) ? ECANCELED : 0;
+}
+
+int await_for(future_t* future, uint64_t timeout_ns, void** result) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+    return await_until(future, &deadline, result);
+}
@@ -9,6 +9,9 @@
 #ifndef __FUTURE_H__
 #define __FUTURE_H__
 
+#include <stdint.h>
+#include <time.h>
+
 #include "../threadpool/threadpool.h"
 
 /**
@@ -18,17 +21,43 @@ typedef struct callable {
   void *(*function)(void*, size_t, size_t*); ///< f(arg, argsz, result_size);
   void* arg; ///<                                         array of arguments;
   size_t argsz; ///<                                     number of arguments;
+  cancel_token_t* token; ///<       token cancelling the future, may be NULL;
 } callable_t;
 
+struct future;
+
+/**
+ * State of the future.
+ */
+typedef enum future_state {
+    FUTURE_PENDING, ///<                 result is being computed;
+    FUTURE_WAITED, ///<  pending, some threads sleep on the state;
+    FUTURE_READY, ///<                     result is available;
+    FUTURE_CANCELLED, ///<         finished without a valid result;
+} future_state_t;
+
+/**
+ * Function run when a future is finished.
+ */
+typedef struct continuation {
+    void (*function)(struct continuation*, struct future*); ///< f(self, finished future);
+    struct continuation* next; ///<              next continuation of the same future;
+} continuation_t;
+
 /**
  * Future that will get the value asynchronously
- * (similar to C++ std::future).
+ * (similar to C++ std::shared_future: any number of threads
+ * can await it, any number of times).
  */
 typedef struct future {
     callable_t callable; ///<                 callable function;
-    sem_t finished; ///< status of the future(pending/finished);
+    atomic_int state; ///<   future_state_t, futex word for awaiters;
     void* result; ///<    pointer to the result of the function;
     size_t result_size; ///<                 size of the result;
+    thread_pool_t* pool; ///<  pool the future is computed on;
+    _Atomic(continuation_t*) continuations; ///< run when finished;
+    continuation_t continuation; ///< registered by map in the source;
+    cancel_token_t cancel; ///<       set by future_cancel;
 } future_t;
 
 /** @brief Create a future variable that will store the result of callable.
@@ -43,9 +72,27 @@ typedef struct future {
  */
 int async(thread_pool_t* pool, future_t* future, callable_t callable);
 
+/** @brief Create many future variables at once.
+ * Equivalent to calling async for every pair of future and callable,
+ * but all tasks are added to the thread-pool with a single defer_batch.
+ * If the pool takes only some of the tasks (a full ring buffer, a pool being
+ * destroyed), the futures of the others are finished as cancelled, so every
+ * future can be awaited even when an error is returned.
+ * @param[in,out] pool      –                    pointer to the thread-pool;
+ * @param[in,out] futures   – array of variables that will store the results;
+ * @param[in] callables     –      functions that will be run by thread-pool;
+ * @param[in] count         –                 number of futures to create;
+ * @return @p 0, if futures were created correctly
+ * and callable functions have been added to thread-pool.
+ * Non-zero value, if errors occurred.
+ */
+int async_batch(thread_pool_t* pool, future_t* futures, const callable_t* callables,
+                size_t count);
+
 /** @brief Create a future variable that will store the result of callable.
- * Create runnable function that will run callable function
- * and add a new task to the thread-pool.
+ * Register a continuation in the source future. When the source is finished,
+ * the continuation adds a task running the function to the thread-pool,
+ * so no thread of the pool waits for the source.
  * @param[in,out] pool     – pointer to the thread-pool;
  * @param[in,out] future   – pointer to the future variable that stores the arguments
  *                                                                     to the function;
@@ -57,10 +104,99 @@ int async(thread_pool_t* pool, future_t* future, callable_t callable);
 int map(thread_pool_t* pool, future_t* future, future_t* from,
         void* (*function)(void*, size_t, size_t*));
 
+/** @brief Create a future finished when all of the inputs are finished.
+ * Every input gets a continuation decrementing an atomic counter,
+ * the last one finishes the combined future, so no thread waits.
+ * The result of the combined future is the @p inputs array
+ * and its size is @p count.
+ * @param[in,out] pool   –           pointer to the thread-pool;
+ * @param[out] out       –             the combined future;
+ * @param[in,out] inputs – array of pointers to the input futures;
+ * @param[in] count      –                   number of inputs;
+ * @return @p 0, if the combined future was created correctly.
+ * Non-zero value, if errors occurred.
+ */
+int when_all(thread_pool_t* pool, future_t* out, future_t** inputs, size_t count);
+
+/** @brief Create a future finished when any of the inputs is finished.
+ * The first finished input wins, the result of the combined future
+ * is the pointer to it and the size is its index in @p inputs.
+ * @param[in,out] pool   –           pointer to the thread-pool;
+ * @param[out] out       –             the combined future;
+ * @param[in,out] inputs – array of pointers to the input futures;
+ * @param[in] count      –         number of inputs (positive);
+ * @return @p 0, if the combined future was created correctly.
+ * Non-zero value, if errors occurred.
+ */
+int when_any(thread_pool_t* pool, future_t* out, future_t** inputs, size_t count);
+
+/** @brief Create a future that is already finished.
+ * Futures created this way can be used as the source of map.
+ * @param[out] future     –    pointer to the future;
+ * @param[in] result      –  result of the future;
+ * @param[in] result_size – size of the result;
+ * @return @p 0, if future was created correctly.
+ * Non-zero value, if errors occurred.
+ */
+int future_init_ready(future_t* future, void* result, size_t result_size);
+
+/** @brief Request cancellation of the future.
+ * Cancellation is cooperative. A future that has not started yet finishes as
+ * cancelled when a thread takes its task, without calling the function.
+ * A running function can't be stopped; it can poll the token passed in
+ * callable.token (and to itself through its arguments) and return early.
+ * A future whose cancellation was requested (through future_cancel or its
+ * callable.token) before it finished ends in FUTURE_CANCELLED, and so does
+ * every future mapped from it, directly or through a chain of maps, and
+ * when_all of it.
+ * @param[in,out] future – pointer to the future;
+ */
+void future_cancel(future_t* future);
+
+/** @brief Check if the future finished as cancelled.
+ * @param[in] future – pointer to the future;
+ * @return @p true, if the future is in FUTURE_CANCELLED.
+ */
+bool future_cancelled(future_t* future);
+
 /** @brief Wait for future to finish.
- * Sleep on semaphore until the future is calculated.
+ * Sleep on the state of the future until it is calculated.
+ * Any number of threads can await the same future; when the result
+ * is already available await only reads the state.
+ * A cancelled future returns whatever its function returned,
+ * or @p NULL if the function was not called.
  * @param[in,out] future  – pointer to a variable that will store the callable result;
  */
 void *await(future_t *future);
 
+/** @brief Read the result if the future is finished.
+ * Never blocks. A cancelled future is finished too, see future_cancelled.
+ * @param[in] future  –       pointer to the future;
+ * @param[out] result – result of the finished future;
+ * @return @p true, if the future is finished.
+ */
+bool future_try_get(future_t* future, void** result);
+
+/** @brief Wait for future to finish, but not longer than until the deadline.
+ * After timeout the future can be waited for (or awaited) again.
+ * @param[in,out] future – pointer to the future;
+ * @param[in] deadline   – absolute CLOCK_MONOTONIC time;
+ * @param[out] result    –   result of the future;
+ * @return @p 0, if the future is finished, @p ETIMEDOUT if the deadline passed,
+ * @p ECANCELED if the future was cancelled.
+ * Other non-zero value, if errors occurred.
+ */
+int await_until(future_t* future, const struct timespec* deadline, void** result);
+
+/** @brief Wait for future to finish, but not longer than timeout_ns.
+ * Same as await_until with the deadline timeout_ns nanoseconds from now.
+ * @param[in,out] future – pointer to the future;
+ * @param[in] timeout_ns – timeout in nanoseconds;
+ * @param[out] result    –  result of the future;
+ * @return @p 0, if the future is finished, @p ETIMEDOUT if the timeout passed,
+ * @p ECANCELED if the future was cancelled.
+ * Other non-zero value, if errors occurred.
+ */
+int await_for(future_t* future, uint64_t timeout_ns, void** result);
+
 #endif // __FUTURE_H__
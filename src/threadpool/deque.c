@@ -0,0 +1,205 @@
+/** @file
+ * Work-stealing deque implementation.
+ * Based on "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * by N. M. Lê, A. Pop, A. Cohen and F. Zappa Nardelli.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "deque.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Number of machine words in a single slot.
+ */
+#define SLOT_WORDS (sizeof(task_t) / sizeof(uintptr_t))
+
+/**
+ * Number of machine words before the inline arguments.
+ */
+#define HEADER_WORDS (offsetof(task_t, storage) / sizeof(uintptr_t))
+
+_Static_assert(sizeof(task_t) % sizeof(uintptr_t) == 0,
+               "task_t must consist of whole words");
+_Static_assert(offsetof(task_t, storage) % sizeof(uintptr_t) == 0,
+               "storage of task_t must start at a word boundary");
+
+/** @brief Allocate a new circular array.
+ * @param[in] capacity – number of slots;
+ * @return Pointer to the array or @p NULL if malloc failed.
+ */
+static deque_array_t* array_create(size_t capacity) {
+    deque_array_t* array = malloc(sizeof(deque_array_t)
+                                  + capacity * SLOT_WORDS * sizeof(_Atomic(uintptr_t)));
+    if (array == NULL) {
+        fprintf(stderr, "ERROR: deque array malloc failed\n");
+        return NULL;
+    }
+    array->capacity = capacity;
+    array->previous = NULL;
+    return array;
+}
+
+/** @brief Number of words used by the task.
+ * @param[in] inline_size – number of inline argument bytes;
+ * @return Number of words to be copied.
+ */
+static size_t used_words(size_t inline_size) {
+    if (inline_size > THREAD_POOL_INLINE_ARGS) {
+        // Torn read, the result is discarded anyway.
+        inline_size = THREAD_POOL_INLINE_ARGS;
+    }
+    return HEADER_WORDS + (inline_size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+}
+
+/** @brief Write the task to the slot.
+ * Slots are written word by word with relaxed atomics, so a thief
+ * reading a slot concurrently never causes a data race. A torn read is
+ * detected by the failed CAS on top and discarded.
+ * Only the words used by the task are written.
+ * @param[in,out] array – pointer to the array;
+ * @param[in] index     –   index of the element;
+ * @param[in] task      –  element to be written;
+ */
+static void slot_store(deque_array_t* array, long long index, const task_t* task) {
+    uintptr_t words[SLOT_WORDS];
+    size_t count = used_words(task->inline_size);
+    memcpy(words, task, count * sizeof(uintptr_t));
+    _Atomic(uintptr_t)* slot = &array->words[(index & (array->capacity - 1)) * SLOT_WORDS];
+    for (size_t i = 0; i < count; ++i) {
+        atomic_store_explicit(&slot[i], words[i], memory_order_relaxed);
+    }
+}
+
+/** @brief Read the task from the slot.
+ * @param[in] array – pointer to the array;
+ * @param[in] index – index of the element;
+ * @param[out] task – element stored in the slot;
+ */
+static void slot_load(deque_array_t* array, long long index, task_t* task) {
+    uintptr_t words[SLOT_WORDS];
+    _Atomic(uintptr_t)* slot = &array->words[(index & (array->capacity - 1)) * SLOT_WORDS];
+    for (size_t i = 0; i < HEADER_WORDS; ++i) {
+        words[i] = atomic_load_explicit(&slot[i], memory_order_relaxed);
+    }
+    memcpy(task, words, HEADER_WORDS * sizeof(uintptr_t));
+    size_t count = used_words(task->inline_size);
+    for (size_t i = HEADER_WORDS; i < count; ++i) {
+        words[i] = atomic_load_explicit(&slot[i], memory_order_relaxed);
+    }
+    memcpy(task, words, count * sizeof(uintptr_t));
+}
+
+/** @brief Double the capacity of the deque.
+ * The old array is kept, because thieves may still read from it.
+ * @param[in,out] deque – pointer to the deque;
+ * @param[in] top       –    current top index;
+ * @param[in] bottom    – current bottom index;
+ * @return Pointer to the new array or @p NULL if malloc failed.
+ */
+static deque_array_t* grow(deque_t* deque, long long top, long long bottom) {
+    deque_array_t* old = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    deque_array_t* new = array_create(2 * old->capacity);
+    if (new == NULL) {
+        return NULL;
+    }
+    task_t task;
+    for (long long i = top; i < bottom; ++i) {
+        slot_load(old, i, &task);
+        slot_store(new, i, &task);
+    }
+    new->previous = old;
+    atomic_store_explicit(&deque->array, new, memory_order_release);
+    atomic_fetch_add_explicit(&deque->allocations, 1, memory_order_relaxed);
+    return new;
+}
+
+int deque_init(deque_t* deque, size_t capacity) {
+    deque_array_t* array = array_create(capacity);
+    if (array == NULL) {
+        return -1;
+    }
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    atomic_init(&deque->allocations, 0);
+    return 0;
+}
+
+void deque_destroy(deque_t* deque) {
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    while (array != NULL) {
+        deque_array_t* previous = array->previous;
+        free(array);
+        array = previous;
+    }
+}
+
+int deque_push(deque_t* deque, const task_t* task) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > (long long) array->capacity - 1) {
+        array = grow(deque, top, bottom);
+        if (array == NULL) {
+            return -1;
+        }
+    }
+
+    slot_store(array, bottom, task);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return 0;
+}
+
+bool deque_take(deque_t* deque, task_t* task) {
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // Deque was empty.
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    slot_load(array, bottom, task);
+    if (top < bottom) {
+        return true;
+    }
+
+    // Last element, race with thieves.
+    bool success = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+
+    return success;
+}
+
+deque_status_t deque_steal(deque_t* deque, task_t* task) {
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return DEQUE_EMPTY;
+    }
+
+    deque_array_t* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    slot_load(array, top, task);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return DEQUE_ABORT;
+    }
+
+    return DEQUE_SUCCESS;
+}
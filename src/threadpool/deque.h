@@ -0,0 +1,85 @@
+/** @file
+ * Work-stealing deque header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __DEQUE_H__
+#define __DEQUE_H__
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+/**
+ * Circular array holding the elements of the deque.
+ */
+typedef struct deque_array {
+    size_t capacity; ///<           number of slots (power of two);
+    struct deque_array* previous; ///< array replaced by this one;
+    _Atomic(uintptr_t) words[]; ///<     slots stored word by word;
+} deque_array_t;
+
+/**
+ * Chase-Lev work-stealing deque.
+ * Only the owner calls deque_push and deque_take (LIFO end),
+ * any other thread may call deque_steal (FIFO end).
+ */
+typedef struct deque {
+    alignas(CACHE_LINE) atomic_llong top; ///<     index of the oldest element;
+    alignas(CACHE_LINE) atomic_llong bottom; ///< index after the newest one;
+    _Atomic(deque_array_t*) array; ///<             current circular array;
+    atomic_size_t allocations; ///<       number of arrays allocated by grow;
+} deque_t;
+
+/**
+ * Result of deque_steal.
+ */
+typedef enum deque_status {
+    DEQUE_SUCCESS, ///<            element was stolen;
+    DEQUE_EMPTY, ///<                deque was empty;
+    DEQUE_ABORT, ///< lost the race with other thread;
+} deque_status_t;
+
+/** @brief Initialize an empty deque.
+ * @param[out] deque   –            pointer to the deque;
+ * @param[in] capacity – initial capacity (power of two);
+ * @return @p 0, if init was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int deque_init(deque_t* deque, size_t capacity);
+
+/** @brief Deallocate the deque and all of its arrays.
+ * @param[in,out] deque – pointer to the deque;
+ */
+void deque_destroy(deque_t* deque);
+
+/** @brief Push the task at the bottom of the deque.
+ * Can be called only by the owner of the deque.
+ * @param[in,out] deque – pointer to the deque;
+ * @param[in] task      –   element to be pushed;
+ * @return @p 0, if push was finished correctly.
+ * Non-zero value, if the array could not grow.
+ */
+int deque_push(deque_t* deque, const task_t* task);
+
+/** @brief Pop the newest task from the bottom of the deque.
+ * Can be called only by the owner of the deque.
+ * @param[in,out] deque – pointer to the deque;
+ * @param[out] task     –    the popped element;
+ * @return @p true, if an element was popped.
+ */
+bool deque_take(deque_t* deque, task_t* task);
+
+/** @brief Steal the oldest task from the top of the deque.
+ * @param[in,out] deque – pointer to the deque;
+ * @param[out] task     –    the stolen element;
+ * @return Status of the operation.
+ */
+deque_status_t deque_steal(deque_t* deque, task_t* task);
+
+#endif // __DEQUE_H__
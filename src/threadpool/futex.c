@@ -0,0 +1,29 @@
+/** @file
+ * Futex wrappers implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "futex.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int futex_wait(atomic_int* word, int expected, const struct timespec* deadline) {
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline.
+    long err = syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, expected,
+                       deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (err != 0 && errno == ETIMEDOUT) {
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+void futex_wake(atomic_int* word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
@@ -0,0 +1,32 @@
+/** @file
+ * Futex wrappers header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <stdatomic.h>
+#include <time.h>
+
+/** @brief Sleep while the word holds the expected value.
+ * Returns immediately if the word has already changed.
+ * Spurious wake-ups are possible, the caller has to check the word again.
+ * @param[in] word     –                    watched word;
+ * @param[in] expected –           value to sleep on;
+ * @param[in] deadline – absolute CLOCK_MONOTONIC time,
+ *                       @p NULL to sleep without limit;
+ * @return @p 0, if woken (or the word changed), @p ETIMEDOUT if the deadline passed.
+ */
+int futex_wait(atomic_int* word, int expected, const struct timespec* deadline);
+
+/** @brief Wake threads sleeping on the word.
+ * @param[in] word  –           watched word;
+ * @param[in] count – number of threads to wake;
+ */
+void futex_wake(atomic_int* word, int count);
+
+#endif // __FUTEX_H__
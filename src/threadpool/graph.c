@@ -0,0 +1,296 @@
+/** @file
+ * Task graph (DAG) scheduler implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "graph.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "futex.h"
+
+/**
+ * Initial capacity of the arrays of nodes and edges.
+ */
+#define GRAPH_INITIAL_CAPACITY 16
+
+/** @brief Make room for one more element of the array.
+ * @param[in,out] array    –   pointer to the array;
+ * @param[in,out] capacity – allocated number of elements;
+ * @param[in] count        –  used number of elements;
+ * @param[in] size         –   size of an element;
+ * @return @p 0, if there is room for the element.
+ * Non-zero value, if realloc failed.
+ */
+static int reserve(void** array, size_t* capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity == 0 ? GRAPH_INITIAL_CAPACITY : 2 * *capacity;
+    void* new_array = realloc(*array, new_capacity * size);
+    if (new_array == NULL) {
+        fprintf(stderr, "ERROR: graph realloc failed\n");
+        return -1;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return 0;
+}
+
+/** @brief Group the edges by source, sort the graph and compute the ranks.
+ * The rank of a node is its cost plus the largest rank of its successors,
+ * so the node with the highest rank starts the critical path.
+ * @param[in,out] graph – pointer to the graph;
+ * @return @p 0, if the graph was prepared correctly.
+ * Non-zero value, if the graph has a cycle or errors occurred.
+ */
+static int prepare(task_graph_t* graph) {
+    size_t count = graph->nodes_count;
+    free(graph->first_successor);
+    free(graph->successors);
+    graph->first_successor = calloc(count + 1, sizeof(size_t));
+    graph->successors = malloc((graph->edges_count + 1) * sizeof(size_t));
+    size_t* order = malloc((count + 1) * sizeof(size_t));
+    size_t* left = malloc((count + 1) * sizeof(size_t));
+    if (graph->first_successor == NULL || graph->successors == NULL
+        || order == NULL || left == NULL) {
+        fprintf(stderr, "ERROR: graph malloc failed\n");
+        free(order);
+        free(left);
+        return -1;
+    }
+
+    // Counting sort of the edges by their sources.
+    for (size_t i = 0; i < graph->edges_count; ++i) {
+        ++graph->first_successor[graph->edges[i].from + 1];
+    }
+    for (size_t i = 0; i < count; ++i) {
+        graph->first_successor[i + 1] += graph->first_successor[i];
+        left[i] = graph->first_successor[i];
+    }
+    for (size_t i = 0; i < graph->edges_count; ++i) {
+        graph->successors[left[graph->edges[i].from]++] = graph->edges[i].to;
+    }
+
+    // Kahn's algorithm, a node is sorted when all of its predecessors are.
+    size_t sorted = 0;
+    for (size_t i = 0; i < count; ++i) {
+        left[i] = graph->nodes[i].predecessors;
+        if (left[i] == 0) {
+            order[sorted++] = i;
+        }
+    }
+    for (size_t i = 0; i < sorted; ++i) {
+        size_t node = order[i];
+        for (size_t j = graph->first_successor[node]; j < graph->first_successor[node + 1]; ++j) {
+            if (--left[graph->successors[j]] == 0) {
+                order[sorted++] = graph->successors[j];
+            }
+        }
+    }
+    free(left);
+    if (sorted < count) {
+        free(order);
+        fprintf(stderr, "ERROR: graph has a cycle\n");
+        return -1;
+    }
+
+    uint64_t max_rank = 1;
+    for (size_t i = count; i-- > 0;) {
+        graph_node_t* node = &graph->nodes[order[i]];
+        uint64_t longest = 0;
+        for (size_t j = graph->first_successor[order[i]];
+             j < graph->first_successor[order[i] + 1]; ++j) {
+            uint64_t rank = graph->nodes[graph->successors[j]].rank;
+            longest = rank > longest ? rank : longest;
+        }
+        node->rank = node->cost + longest;
+        max_rank = node->rank > max_rank ? node->rank : max_rank;
+    }
+    // The upper third of the paths goes first, the lower third last.
+    for (size_t i = 0; i < count; ++i) {
+        graph_node_t* node = &graph->nodes[i];
+        if (node->rank > max_rank / 3 * 2) {
+            node->priority = THREAD_POOL_PRIORITY_HIGH;
+        } else if (node->rank > max_rank / 3) {
+            node->priority = THREAD_POOL_PRIORITY_NORMAL;
+        } else {
+            node->priority = THREAD_POOL_PRIORITY_LOW;
+        }
+    }
+    free(order);
+    graph->prepared = true;
+    return 0;
+}
+
+static void run_node(void* args, size_t argsz);
+
+/** @brief Defer the runnable node.
+ * If the pool rejects it (full ring), the node is run by the current thread.
+ * @param[in,out] node – node to be run;
+ */
+static void schedule(graph_node_t* node) {
+    runnable_t runnable = {.function = run_node, .arg = node, .argsz = 0};
+    if (defer_prio(node->graph->pool, runnable, node->priority) != 0) {
+        run_node(node, 0);
+    }
+}
+
+/** @brief Run the node and the successors it makes runnable.
+ * The successor with the highest rank is run next by the same thread,
+ * the others are deferred.
+ * @param[in,out] args – node to be run;
+ * @param[in] argsz    –      unused;
+ */
+static void run_node(void* args, size_t argsz __attribute__((unused))) {
+    graph_node_t* node = args;
+    task_graph_t* graph = node->graph;
+    while (node != NULL) {
+        if (!cancel_requested(node->runnable.token)) {
+            node->runnable.function(node->runnable.arg, node->runnable.argsz);
+        }
+
+        size_t index = node - graph->nodes;
+        graph_node_t* next = NULL;
+        for (size_t j = graph->first_successor[index]; j < graph->first_successor[index + 1];
+             ++j) {
+            graph_node_t* successor = &graph->nodes[graph->successors[j]];
+            if (atomic_fetch_sub(&successor->remaining, 1) != 1) {
+                continue;
+            }
+            if (next == NULL) {
+                next = successor;
+            } else if (successor->rank > next->rank) {
+                schedule(next);
+                next = successor;
+            } else {
+                schedule(successor);
+            }
+        }
+
+        // Nothing of the graph is touched after the last node, the waiter may reuse it.
+        if (atomic_fetch_sub(&graph->unfinished, 1) == 1) {
+            atomic_store(&graph->done, 1);
+            futex_wake(&graph->done, INT_MAX);
+            return;
+        }
+        node = next;
+    }
+}
+
+/** @brief Compare two nodes by rank, descending, for qsort.
+ * @param[in] a – first node;
+ * @param[in] b – second node;
+ * @return Negative, zero or positive value like strcmp.
+ */
+static int compare_ranks(const void* a, const void* b) {
+    uint64_t x = (*(graph_node_t* const*) a)->rank;
+    uint64_t y = (*(graph_node_t* const*) b)->rank;
+    return (x < y) - (x > y);
+}
+
+void task_graph_init(task_graph_t* graph) {
+    graph->nodes = NULL;
+    graph->nodes_count = 0;
+    graph->nodes_capacity = 0;
+    graph->edges = NULL;
+    graph->edges_count = 0;
+    graph->edges_capacity = 0;
+    graph->first_successor = NULL;
+    graph->successors = NULL;
+    graph->prepared = false;
+    graph->pool = NULL;
+    atomic_init(&graph->unfinished, 0);
+    atomic_init(&graph->done, 1);
+}
+
+void task_graph_destroy(task_graph_t* graph) {
+    free(graph->nodes);
+    free(graph->edges);
+    free(graph->first_successor);
+    free(graph->successors);
+}
+
+int task_graph_add(task_graph_t* graph, runnable_t runnable, uint64_t cost, size_t* node) {
+    if (reserve((void**) &graph->nodes, &graph->nodes_capacity, graph->nodes_count,
+                sizeof(graph_node_t)) != 0) {
+        return -1;
+    }
+    graph_node_t* added = &graph->nodes[graph->nodes_count];
+    added->runnable = runnable;
+    added->cost = cost;
+    added->rank = cost;
+    added->priority = THREAD_POOL_PRIORITY_NORMAL;
+    added->predecessors = 0;
+    atomic_init(&added->remaining, 0);
+    added->graph = graph;
+    *node = graph->nodes_count++;
+    graph->prepared = false;
+    return 0;
+}
+
+int task_graph_edge(task_graph_t* graph, size_t from, size_t to) {
+    if (from >= graph->nodes_count || to >= graph->nodes_count) {
+        fprintf(stderr, "ERROR: unknown graph node\n");
+        return -1;
+    }
+    if (reserve((void**) &graph->edges, &graph->edges_capacity, graph->edges_count,
+                sizeof(graph_edge_t)) != 0) {
+        return -1;
+    }
+    graph->edges[graph->edges_count].from = from;
+    graph->edges[graph->edges_count].to = to;
+    ++graph->edges_count;
+    ++graph->nodes[to].predecessors;
+    graph->prepared = false;
+    return 0;
+}
+
+int task_graph_run(task_graph_t* graph, thread_pool_t* pool) {
+    if (!graph->prepared && prepare(graph) != 0) {
+        return -1;
+    }
+    if (graph->nodes_count == 0) {
+        atomic_store(&graph->done, 1);
+        return 0;
+    }
+
+    size_t roots_count = 0;
+    graph_node_t** roots = malloc(graph->nodes_count * sizeof(graph_node_t*));
+    if (roots == NULL) {
+        fprintf(stderr, "ERROR: graph malloc failed\n");
+        return -1;
+    }
+    graph->pool = pool;
+    for (size_t i = 0; i < graph->nodes_count; ++i) {
+        graph_node_t* node = &graph->nodes[i];
+        atomic_store_explicit(&node->remaining, node->predecessors, memory_order_relaxed);
+        if (node->predecessors == 0) {
+            roots[roots_count++] = node;
+        }
+    }
+    atomic_store(&graph->unfinished, graph->nodes_count);
+    atomic_store(&graph->done, 0);
+
+    // Roots on the critical path go first.
+    qsort(roots, roots_count, sizeof(graph_node_t*), compare_ranks);
+    for (size_t i = 0; i < roots_count; ++i) {
+        schedule(roots[i]);
+    }
+    free(roots);
+    return 0;
+}
+
+void task_graph_wait(task_graph_t* graph) {
+    if (thread_pool_help_wait(&graph->done, 0, NULL) == 0) {
+        return;
+    }
+    while (atomic_load(&graph->done) == 0) {
+        futex_wait(&graph->done, 0, NULL);
+    }
+}
@@ -0,0 +1,113 @@
+/** @file
+ * Task graph (DAG) scheduler header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __GRAPH_H__
+#define __GRAPH_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+struct task_graph;
+
+/**
+ * Single node of the graph.
+ */
+typedef struct graph_node {
+    runnable_t runnable; ///<                         task of the node;
+    uint64_t cost; ///<            estimated cost of the task (any unit);
+    uint64_t rank; ///< cost of the longest path from the node to a sink;
+    thread_pool_priority_t priority; ///< priority derived from the rank;
+    size_t predecessors; ///<              number of incoming edges;
+    atomic_size_t remaining; ///< predecessors not finished in this run;
+    struct task_graph* graph; ///<              graph of the node;
+} graph_node_t;
+
+/**
+ * Directed edge of the graph.
+ */
+typedef struct graph_edge {
+    size_t from; ///< node that has to finish first;
+    size_t to; ///<           node that waits for it;
+} graph_edge_t;
+
+/**
+ * Directed acyclic graph of tasks, built once and run any number of times.
+ */
+typedef struct task_graph {
+    graph_node_t* nodes; ///<                         array of the nodes;
+    size_t nodes_count; ///<                          number of the nodes;
+    size_t nodes_capacity; ///<               allocated number of nodes;
+    graph_edge_t* edges; ///<                         array of the edges;
+    size_t edges_count; ///<                          number of the edges;
+    size_t edges_capacity; ///<               allocated number of edges;
+    size_t* first_successor; ///< index in successors of every node, plus the end;
+    size_t* successors; ///<          targets of the edges grouped by source;
+    bool prepared; ///< information if successors and ranks are up to date;
+    thread_pool_t* pool; ///<                pool of the current run;
+    atomic_size_t unfinished; ///<   nodes not finished in this run;
+    atomic_int done; ///<         futex word set when the run is finished;
+} task_graph_t;
+
+/** @brief Initialize an empty graph.
+ * @param[out] graph – pointer to the graph;
+ */
+void task_graph_init(task_graph_t* graph);
+
+/** @brief Deallocate the graph.
+ * The graph must not be running.
+ * @param[in,out] graph – pointer to the graph;
+ */
+void task_graph_destroy(task_graph_t* graph);
+
+/** @brief Add a node to the graph.
+ * The graph must not be running.
+ * @param[in,out] graph – pointer to the graph;
+ * @param[in] runnable  –   task of the node;
+ * @param[in] cost      – estimated cost of the task, @p 1 if unknown;
+ * @param[out] node     –  index of the new node;
+ * @return @p 0, if the node was added correctly.
+ * Non-zero value, if errors occurred.
+ */
+int task_graph_add(task_graph_t* graph, runnable_t runnable, uint64_t cost, size_t* node);
+
+/** @brief Make the node to wait for the other one.
+ * The graph must not be running.
+ * @param[in,out] graph – pointer to the graph;
+ * @param[in] from      – node that has to finish first;
+ * @param[in] to        –         node that waits for it;
+ * @return @p 0, if the edge was added correctly.
+ * Non-zero value, if a node does not exist or errors occurred.
+ */
+int task_graph_edge(task_graph_t* graph, size_t from, size_t to);
+
+/** @brief Start a run of the graph on the pool.
+ * Every node gets an atomic counter of the predecessors left; the node that
+ * brings it to zero makes its successor runnable, so nothing waits in the pool.
+ * Of the successors made runnable together, the one with the longest path to
+ * the end of the graph (the critical path) is run right away by the same thread,
+ * the others are deferred with a priority depending on their path.
+ * The first run after a change sorts the graph and checks it for cycles.
+ * A node whose token is cancelled is not run, but its successors are.
+ * The graph can be run again after task_graph_wait, but not concurrently.
+ * @param[in,out] graph – pointer to the graph;
+ * @param[in, out] pool – pointer to thread-pool;
+ * @return @p 0, if the run was started correctly.
+ * Non-zero value, if the graph has a cycle or errors occurred.
+ */
+int task_graph_run(task_graph_t* graph, thread_pool_t* pool);
+
+/** @brief Wait until the run of the graph is finished.
+ * Inside a task of a pool the waiter helps its pool instead of blocking.
+ * @param[in,out] graph – pointer to the graph;
+ */
+void task_graph_wait(task_graph_t* graph);
+
+#endif // __GRAPH_H__
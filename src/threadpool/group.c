@@ -0,0 +1,92 @@
+/** @file
+ * Task groups implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "group.h"
+
+#include <limits.h>
+
+#include "futex.h"
+
+/**
+ * Bit of the pending word set when somebody sleeps on it.
+ */
+#define GROUP_WAITED (1 << 30)
+
+/**
+ * Mask of the number of unfinished tasks in the pending word.
+ */
+#define GROUP_COUNT (GROUP_WAITED - 1)
+
+/**
+ * Inline argument of a group task.
+ */
+typedef struct group_task {
+    runnable_t runnable; ///<     the deferred task;
+    task_group_t* group; ///< group of the task;
+} group_task_t;
+
+/** @brief Mark a task of the group as finished.
+ * The last task clears the waiting bit in the same atomic step, so the group
+ * is not touched after the waiters can see it empty, except for the wakeup.
+ * @param[in,out] group – pointer to the group;
+ */
+static void finish(task_group_t* group) {
+    int old = atomic_load_explicit(&group->pending, memory_order_relaxed);
+    int next;
+    do {
+        next = (old & GROUP_COUNT) == 1 ? 0 : old - 1;
+    } while (!atomic_compare_exchange_weak_explicit(&group->pending, &old, next,
+                                                    memory_order_release, memory_order_relaxed));
+    if (old == (GROUP_WAITED | 1)) {
+        futex_wake(&group->pending, INT_MAX);
+    }
+}
+
+/** @brief Run the task of the group and count it as finished.
+ * @param[in,out] args – inline group_task_t;
+ * @param[in] argsz    –     unused;
+ */
+static void run_member(void* args, size_t argsz __attribute__((unused))) {
+    group_task_t* task = args;
+    if (!cancel_requested(task->runnable.token)) {
+        task->runnable.function(task->runnable.arg, task->runnable.argsz);
+    }
+    finish(task->group);
+}
+
+void task_group_init(task_group_t* group, thread_pool_t* pool) {
+    group->pool = pool;
+    atomic_init(&group->pending, 0);
+}
+
+int task_group_defer(task_group_t* group, runnable_t runnable) {
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    group_task_t task = {.runnable = runnable, .group = group};
+    int err = defer_inline(group->pool, run_member, &task, sizeof(task));
+    if (err != 0) {
+        finish(group);
+    }
+    return err;
+}
+
+void task_group_wait(task_group_t* group) {
+    int pending = atomic_load_explicit(&group->pending, memory_order_acquire);
+    while ((pending & GROUP_COUNT) != 0) {
+        if ((pending & GROUP_WAITED) == 0) {
+            if (!atomic_compare_exchange_weak(&group->pending, &pending,
+                                              pending | GROUP_WAITED)) {
+                continue;
+            }
+            pending |= GROUP_WAITED;
+        }
+        if (thread_pool_help_wait(&group->pending, pending, NULL) != 0) {
+            futex_wait(&group->pending, pending, NULL);
+        }
+        pending = atomic_load_explicit(&group->pending, memory_order_acquire);
+    }
+}
@@ -0,0 +1,52 @@
+/** @file
+ * Task groups header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __GROUP_H__
+#define __GROUP_H__
+
+#include <stdatomic.h>
+
+#include "threadpool.h"
+
+/**
+ * Group of tasks that can be waited for together (fork/join).
+ * The whole state is a single word: the number of unfinished tasks
+ * and a bit telling that somebody sleeps on it.
+ */
+typedef struct task_group {
+    thread_pool_t* pool; ///< pool the tasks are deferred to;
+    atomic_int pending; ///<  unfinished tasks and the waiting bit;
+} task_group_t;
+
+/** @brief Initialize an empty group.
+ * The group holds no resources, it does not have to be destroyed.
+ * @param[out] group – pointer to the group;
+ * @param[in] pool   – pool the tasks of the group run on;
+ */
+void task_group_init(task_group_t* group, thread_pool_t* pool);
+
+/** @brief Defer the task as a member of the group.
+ * The runnable is stored inline, so no memory is allocated. A task whose
+ * token is cancelled before it starts is not run, but still counted as finished.
+ * Tasks of the group may defer more tasks to it.
+ * @param[in,out] group – pointer to the group;
+ * @param[in] runnable  – task to be run;
+ * @return @p 0, if the task was deferred correctly.
+ * Non-zero value, if errors occurred (the task is not part of the group then).
+ */
+int task_group_defer(task_group_t* group, runnable_t runnable);
+
+/** @brief Wait until every task of the group is finished.
+ * Only the last finished task wakes the waiters, with a single futex call,
+ * and only if somebody sleeps. Inside a task of a pool the waiter helps
+ * its pool instead of blocking. The group can be reused after the wait.
+ * @param[in,out] group – pointer to the group;
+ */
+void task_group_wait(task_group_t* group);
+
+#endif // __GROUP_H__
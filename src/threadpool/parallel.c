@@ -0,0 +1,213 @@
+/** @file
+ * Parallel loops implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "parallel.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "futex.h"
+
+/**
+ * Number of chunks per thread when the grain is chosen automatically.
+ */
+#define CHUNKS_PER_THREAD 8
+
+/**
+ * What the loop does with its chunks.
+ */
+typedef struct loop_body {
+    parallel_body_t body; ///<                   body of parallel_for;
+    parallel_reduce_body_t reduce; ///< body of parallel_reduce, NULL for parallel_for;
+    parallel_combine_t combine; ///<        combiner of the reduction;
+    const void* identity; ///<       neutral value of the reduction;
+    size_t value_size; ///<          size of the reduced value;
+    void* ctx; ///<                         argument of the body;
+} loop_body_t;
+
+/**
+ * State of a single loop, shared by the caller and the helpers.
+ */
+typedef struct loop {
+    alignas(CACHE_LINE) atomic_size_t next; ///<   first chunk not claimed yet;
+    alignas(CACHE_LINE) atomic_size_t done; ///<  number of finished iterations;
+    atomic_int finished; ///<            futex word set after the last chunk;
+    atomic_size_t references; ///< number of threads using the loop;
+    atomic_size_t accumulators; ///< number of claimed accumulators;
+    size_t begin; ///<                             first iteration;
+    size_t end; ///<                      iteration after the last one;
+    size_t chunks; ///<                            number of chunks;
+    size_t total; ///<                        number of iterations;
+    size_t grain; ///<                number of iterations in a chunk;
+    size_t stride; ///<    distance between accumulators in bytes;
+    loop_body_t body; ///<                        body of the loop;
+    alignas(CACHE_LINE) unsigned char values[]; ///< accumulators, one per thread;
+} loop_t;
+
+/** @brief Drop a reference to the loop, free it with the last one.
+ * Helpers can start after the caller has returned, so the loop lives on the heap.
+ * @param[in,out] loop – pointer to the loop;
+ */
+static void release(loop_t* loop) {
+    if (atomic_fetch_sub(&loop->references, 1) == 1) {
+        free(loop);
+    }
+}
+
+/** @brief Claim and run chunks until there are none left.
+ * A reducing thread takes its accumulator with the first chunk it claims,
+ * so every claimed accumulator is final once the last chunk is finished.
+ * @param[in,out] loop – pointer to the loop;
+ */
+static void run_chunks(loop_t* loop) {
+    void* accumulator = NULL;
+    while (true) {
+        // Chunks are claimed by index, so the counter can't wrap near SIZE_MAX.
+        size_t chunk = atomic_fetch_add_explicit(&loop->next, 1, memory_order_relaxed);
+        if (chunk >= loop->chunks) {
+            return;
+        }
+        size_t begin = loop->begin + chunk * loop->grain;
+        size_t end = chunk == loop->chunks - 1 ? loop->end : begin + loop->grain;
+        if (loop->body.reduce == NULL) {
+            loop->body.body(loop->body.ctx, begin, end);
+        } else {
+            if (accumulator == NULL) {
+                size_t index = atomic_fetch_add_explicit(&loop->accumulators, 1,
+                                                         memory_order_relaxed);
+                accumulator = loop->values + index * loop->stride;
+                memcpy(accumulator, loop->body.identity, loop->body.value_size);
+            }
+            loop->body.reduce(loop->body.ctx, begin, end, accumulator);
+        }
+        if (atomic_fetch_add(&loop->done, end - begin) + (end - begin) == loop->total) {
+            atomic_store(&loop->finished, 1);
+            futex_wake(&loop->finished, 1);
+        }
+    }
+}
+
+/** @brief Function of the helper tasks.
+ * @param[in,out] args – pointer to the loop;
+ * @param[in] argsz    – unused;
+ */
+static void helper(void* args, size_t argsz __attribute__((unused))) {
+    loop_t* loop = args;
+    run_chunks(loop);
+    release(loop);
+}
+
+/** @brief Run the loop on the pool and wait for it.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] begin     – first iteration;
+ * @param[in] end       – iteration after the last one;
+ * @param[in] grain     – number of iterations in a chunk, @p 0 to choose it automatically;
+ * @param[in] body      – what the loop does;
+ * @param[out] result   – reduced value, unused by parallel_for;
+ * @return @p 0, if the loop was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+static int run_loop(thread_pool_t* pool, size_t begin, size_t end, size_t grain,
+                    const loop_body_t* body, void* result) {
+    bool reducing = body->reduce != NULL;
+    if (reducing) {
+        memcpy(result, body->identity, body->value_size);
+    }
+    if (begin >= end) {
+        return 0;
+    }
+    size_t total = end - begin;
+    if (grain == 0) {
+        grain = total / (CHUNKS_PER_THREAD * (pool->pool_size + 1));
+        if (grain == 0) {
+            grain = 1;
+        }
+    }
+    if (total <= grain) {
+        if (reducing) {
+            body->reduce(body->ctx, begin, end, result);
+        } else {
+            body->body(body->ctx, begin, end);
+        }
+        return 0;
+    }
+
+    // The caller takes one chunk itself, the others may go to helpers.
+    size_t chunks = total / grain + (total % grain != 0);
+    size_t helpers = chunks - 1 < pool->pool_size ? chunks - 1 : pool->pool_size;
+    size_t stride = 0;
+    if (reducing) {
+        stride = (body->value_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+
+    loop_t* loop = aligned_alloc(alignof(loop_t), sizeof(loop_t) + (helpers + 1) * stride);
+    if (loop == NULL) {
+        fprintf(stderr, "ERROR: loop malloc failed\n");
+        return -1;
+    }
+    atomic_init(&loop->next, 0);
+    atomic_init(&loop->done, 0);
+    atomic_init(&loop->finished, 0);
+    atomic_init(&loop->references, 1);
+    atomic_init(&loop->accumulators, 0);
+    loop->begin = begin;
+    loop->end = end;
+    loop->chunks = chunks;
+    loop->total = total;
+    loop->grain = grain;
+    loop->stride = stride;
+    loop->body = *body;
+
+    runnable_t task = {.function = helper, .arg = loop, .argsz = 0};
+    for (size_t i = 0; i < helpers; ++i) {
+        atomic_fetch_add(&loop->references, 1);
+        if (defer(pool, task) != 0) {
+            // The caller runs the chunks of the missing helper.
+            atomic_fetch_sub(&loop->references, 1);
+            break;
+        }
+    }
+
+    run_chunks(loop);
+    // Chunks still running belong to other threads, a worker helps its pool meanwhile.
+    if (thread_pool_help_wait(&loop->finished, 0, NULL) != 0) {
+        while (atomic_load(&loop->finished) == 0) {
+            futex_wait(&loop->finished, 0, NULL);
+        }
+    }
+
+    if (reducing) {
+        size_t accumulators = atomic_load(&loop->accumulators);
+        for (size_t i = 0; i < accumulators; ++i) {
+            body->combine(body->ctx, result, loop->values + i * stride);
+        }
+    }
+    release(loop);
+    return 0;
+}
+
+int parallel_for(thread_pool_t* pool, size_t begin, size_t end, size_t grain,
+                 parallel_body_t body, void* ctx) {
+    loop_body_t loop_body = {.body = body, .ctx = ctx};
+    return run_loop(pool, begin, end, grain, &loop_body, NULL);
+}
+
+int parallel_reduce(thread_pool_t* pool, size_t begin, size_t end, size_t grain,
+                    const void* identity, size_t value_size, parallel_reduce_body_t body,
+                    parallel_combine_t combine, void* ctx, void* result) {
+    loop_body_t loop_body = {
+        .reduce = body,
+        .combine = combine,
+        .identity = identity,
+        .value_size = value_size,
+        .ctx = ctx,
+    };
+    return run_loop(pool, begin, end, grain, &loop_body, result);
+}
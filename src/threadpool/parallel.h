@@ -0,0 +1,73 @@
+/** @file
+ * Parallel loops header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <stddef.h>
+
+#include "threadpool.h"
+
+/**
+ * Body of the loop, called for the iterations [begin, end).
+ */
+typedef void (*parallel_body_t)(void* ctx, size_t begin, size_t end);
+
+/**
+ * Body of the reduction, accumulates the iterations [begin, end) into the accumulator.
+ */
+typedef void (*parallel_reduce_body_t)(void* ctx, size_t begin, size_t end, void* accumulator);
+
+/**
+ * Combiner of the reduction, accumulates the value from into the value into.
+ */
+typedef void (*parallel_combine_t)(void* ctx, void* into, const void* from);
+
+/** @brief Run the body for every iteration of [begin, end) on the pool.
+ * The range is cut into chunks of grain iterations, which are claimed one by one
+ * by the calling thread and by up to pool_size helper tasks, so fast threads take
+ * more chunks than slow ones. The calling thread works on the loop too and
+ * returns when every chunk is finished, so it is safe to call it from a task
+ * running on the same pool.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] begin     – first iteration;
+ * @param[in] end       – iteration after the last one;
+ * @param[in] grain     – number of iterations in a chunk, @p 0 to choose it automatically;
+ * @param[in] body      – body of the loop;
+ * @param[in] ctx       – argument passed to every call of the body;
+ * @return @p 0, if the loop was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int parallel_for(thread_pool_t* pool, size_t begin, size_t end, size_t grain,
+                 parallel_body_t body, void* ctx);
+
+/** @brief Reduce the iterations of [begin, end) on the pool.
+ * The range is split the same way as in parallel_for. Every thread taking part
+ * in the loop gets a private accumulator on its own cache line, initialized
+ * with a copy of identity, and passes it to every chunk it runs.
+ * When all chunks are finished, the accumulators are combined into result,
+ * so the hot path needs no locking. The order of combining is unspecified,
+ * so combine has to be associative and commutative.
+ * @param[in, out] pool  – pointer to thread-pool;
+ * @param[in] begin      – first iteration;
+ * @param[in] end        – iteration after the last one;
+ * @param[in] grain      – number of iterations in a chunk, @p 0 to choose it automatically;
+ * @param[in] identity   – neutral value of the reduction;
+ * @param[in] value_size – size of the value in bytes;
+ * @param[in] body       – body of the loop;
+ * @param[in] combine    – combiner of the accumulators;
+ * @param[in] ctx        – argument passed to body and combine;
+ * @param[out] result    – reduced value;
+ * @return @p 0, if the loop was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int parallel_reduce(thread_pool_t* pool, size_t begin, size_t end, size_t grain,
+                    const void* identity, size_t value_size, parallel_reduce_body_t body,
+                    parallel_combine_t combine, void* ctx, void* result);
+
+#endif // __PARALLEL_H__
@@ -0,0 +1,63 @@
+/** @file
+ * Bounded MPMC ring buffer header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "threadpool.h"
+
+/**
+ * Single slot of the ring, padded to its own cache line.
+ */
+typedef struct ring_cell {
+    alignas(CACHE_LINE) atomic_size_t sequence; ///< position the cell is ready for;
+    task_t task; ///<                                               stored task;
+} ring_cell_t;
+
+/**
+ * Fixed-capacity lock-free multi-producer/multi-consumer queue
+ * (D. Vyukov's bounded MPMC queue).
+ */
+typedef struct ring {
+    alignas(CACHE_LINE) atomic_size_t enqueue_pos; ///< next position to write;
+    alignas(CACHE_LINE) atomic_size_t dequeue_pos; ///<  next position to read;
+    alignas(CACHE_LINE) size_t mask; ///<         capacity - 1;
+    ring_cell_t* cells; ///<                    array of cells;
+} ring_t;
+
+/** @brief Initialize an empty ring.
+ * @param[out] ring    –               pointer to the ring;
+ * @param[in] capacity – number of cells (power of two);
+ * @return @p 0, if init was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int ring_init(ring_t* ring, size_t capacity);
+
+/** @brief Deallocate the cells of the ring.
+ * @param[in,out] ring – pointer to the ring;
+ */
+void ring_destroy(ring_t* ring);
+
+/** @brief Add the task at the end of the ring.
+ * @param[in,out] ring – pointer to the ring;
+ * @param[in] task     –   element to be added;
+ * @return @p true, if the element was added, @p false if the ring was full.
+ */
+bool ring_push(ring_t* ring, const task_t* task);
+
+/** @brief Pop the first task from the ring.
+ * @param[in,out] ring – pointer to the ring;
+ * @param[out] task    –  the popped element;
+ * @return @p true, if an element was popped, @p false if the ring was empty.
+ */
+bool ring_pop(ring_t* ring, task_t* task);
+
+#endif // __RING_H__
@@ -0,0 +1,77 @@
+/** @file
+ * Slab allocator implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "slab.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Header of every chunk, followed by the objects.
+ */
+typedef struct chunk {
+    struct chunk* next; ///< next allocated chunk;
+    alignas(max_align_t) char objects[]; ///< objects;
+} chunk_t;
+
+/**
+ * Free object, the link is stored in the object itself.
+ */
+typedef struct free_object {
+    struct free_object* next; ///< next free object;
+} free_object_t;
+
+void slab_init(slab_t* slab, size_t object_size, size_t chunk_objects) {
+    size_t align = alignof(max_align_t);
+    if (object_size < sizeof(free_object_t)) {
+        object_size = sizeof(free_object_t);
+    }
+    slab->object_size = (object_size + align - 1) / align * align;
+    slab->chunk_objects = chunk_objects;
+    slab->free_list = NULL;
+    slab->chunks = NULL;
+    slab->allocations = 0;
+}
+
+void slab_destroy(slab_t* slab) {
+    chunk_t* chunk = slab->chunks;
+    while (chunk != NULL) {
+        chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+}
+
+void* slab_alloc(slab_t* slab) {
+    if (slab->free_list == NULL) {
+        chunk_t* chunk = malloc(sizeof(chunk_t) + slab->chunk_objects * slab->object_size);
+        if (chunk == NULL) {
+            fprintf(stderr, "ERROR: slab chunk malloc failed\n");
+            return NULL;
+        }
+        ++slab->allocations;
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        for (size_t i = slab->chunk_objects; i > 0; --i) {
+            slab_free(slab, chunk->objects + (i - 1) * slab->object_size);
+        }
+    }
+
+    free_object_t* object = slab->free_list;
+    slab->free_list = object->next;
+    return object;
+}
+
+void slab_free(slab_t* slab, void* object) {
+    free_object_t* free_object = object;
+    free_object->next = slab->free_list;
+    slab->free_list = free_object;
+}
@@ -0,0 +1,53 @@
+/** @file
+ * Slab allocator header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+/**
+ * Allocator of objects of a single size.
+ * Objects are carved out of larger chunks and recycled through a free list,
+ * so after the warm-up alloc and free do not touch the heap.
+ * The slab is not thread-safe, the owner has to provide synchronization.
+ */
+typedef struct slab {
+    size_t object_size; ///<            size of a single object;
+    size_t chunk_objects; ///<       number of objects in a chunk;
+    void* free_list; ///<              list of the free objects;
+    void* chunks; ///<                 list of allocated chunks;
+    size_t allocations; ///< number of chunks taken from the heap;
+} slab_t;
+
+/** @brief Initialize an empty slab.
+ * @param[out] slab         –           pointer to the slab;
+ * @param[in] object_size   –   size of a single object;
+ * @param[in] chunk_objects – number of objects in a chunk;
+ */
+void slab_init(slab_t* slab, size_t object_size, size_t chunk_objects);
+
+/** @brief Deallocate all chunks of the slab.
+ * @param[in,out] slab – pointer to the slab;
+ */
+void slab_destroy(slab_t* slab);
+
+/** @brief Take an object from the slab.
+ * Allocate a new chunk if there are no free objects.
+ * @param[in,out] slab – pointer to the slab;
+ * @return Pointer to the object or @p NULL if malloc failed.
+ */
+void* slab_alloc(slab_t* slab);
+
+/** @brief Return the object to the slab.
+ * @param[in,out] slab – pointer to the slab;
+ * @param[in] object   – object taken from this slab;
+ */
+void slab_free(slab_t* slab, void* object);
+
+#endif // __SLAB_H__
@@ -0,0 +1,74 @@
+/** @file
+ * Thread-pool statistics implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "stats.h"
+
+#include <time.h>
+
+/** @brief Find the bucket of the duration.
+ * Bucket 0 holds durations below 2 ns, bucket i > 0 holds [2^i, 2^(i+1)),
+ * the last one everything longer.
+ * @param[in] ns – duration in nanoseconds;
+ * @return Index of the bucket.
+ */
+static size_t bucket(uint64_t ns) {
+    if (ns < 2) {
+        return 0;
+    }
+    size_t index = 63 - __builtin_clzll(ns);
+    return index < THREAD_POOL_HISTOGRAM_BUCKETS ? index : THREAD_POOL_HISTOGRAM_BUCKETS - 1;
+}
+
+uint64_t stats_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_init(worker_stats_t* stats) {
+    atomic_init(&stats->submitted, 0);
+    atomic_init(&stats->executed, 0);
+    atomic_init(&stats->cancelled, 0);
+    atomic_init(&stats->steals, 0);
+    atomic_init(&stats->max_queue_depth, 0);
+    atomic_init(&stats->busy_ns, 0);
+    for (size_t i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; ++i) {
+        atomic_init(&stats->wait_histogram[i], 0);
+        atomic_init(&stats->run_histogram[i], 0);
+    }
+}
+
+void stats_task(worker_stats_t* stats, uint64_t enqueued, uint64_t start, uint64_t end) {
+    if (enqueued != 0) {
+        stats_add(&stats->busy_ns, end - start);
+        // Tasks deferred on another CPU may look like they started before they were deferred.
+        stats_add(&stats->wait_histogram[bucket(start > enqueued ? start - enqueued : 0)], 1);
+        stats_add(&stats->run_histogram[bucket(end - start)], 1);
+    }
+    // Published last, so a reader that has seen the task counted sees its histograms too.
+    uint64_t executed = atomic_load_explicit(&stats->executed, memory_order_relaxed);
+    atomic_store_explicit(&stats->executed, executed + 1, memory_order_release);
+}
+
+void stats_collect(thread_pool_stats_t* into, const worker_stats_t* from) {
+    into->submitted += atomic_load_explicit(&from->submitted, memory_order_relaxed);
+    into->executed += atomic_load_explicit(&from->executed, memory_order_acquire);
+    into->cancelled += atomic_load_explicit(&from->cancelled, memory_order_relaxed);
+    into->steals += atomic_load_explicit(&from->steals, memory_order_relaxed);
+    into->busy_ns += atomic_load_explicit(&from->busy_ns, memory_order_relaxed);
+    uint64_t depth = atomic_load_explicit(&from->max_queue_depth, memory_order_relaxed);
+    if (depth > into->max_queue_depth) {
+        into->max_queue_depth = depth;
+    }
+    for (size_t i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; ++i) {
+        into->wait_histogram[i] += atomic_load_explicit(&from->wait_histogram[i],
+                                                        memory_order_relaxed);
+        into->run_histogram[i] += atomic_load_explicit(&from->run_histogram[i],
+                                                       memory_order_relaxed);
+    }
+}
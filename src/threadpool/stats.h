@@ -0,0 +1,78 @@
+/** @file
+ * Thread-pool statistics header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "threadpool.h"
+
+/**
+ * Counters of a single worker.
+ * Written only by the thread of the worker, so every update is a plain
+ * relaxed load and store without a locked instruction. Readers may see
+ * a slightly stale value of every counter, but never a torn one.
+ */
+typedef struct worker_stats {
+    alignas(CACHE_LINE) atomic_uint_least64_t submitted; ///< tasks deferred by the worker;
+    atomic_uint_least64_t executed; ///<                    tasks run by the worker;
+    atomic_uint_least64_t cancelled; ///<  cancelled tasks dropped by the worker;
+    atomic_uint_least64_t steals; ///<           tasks stolen from other workers;
+    atomic_uint_least64_t max_queue_depth; ///< largest backlog seen when deferring;
+    atomic_uint_least64_t busy_ns; ///<                  time spent running tasks;
+    atomic_uint_least64_t wait_histogram[THREAD_POOL_HISTOGRAM_BUCKETS]; ///< enqueue to start;
+    atomic_uint_least64_t run_histogram[THREAD_POOL_HISTOGRAM_BUCKETS]; ///<  run durations;
+} worker_stats_t;
+
+/** @brief Read the monotonic clock.
+ * @return Number of nanoseconds from an unspecified point.
+ */
+uint64_t stats_clock_ns(void);
+
+/** @brief Zero the counters.
+ * @param[out] stats – pointer to the counters;
+ */
+void stats_init(worker_stats_t* stats);
+
+/** @brief Add to a counter written by a single thread.
+ * @param[in,out] counter – pointer to the counter;
+ * @param[in] value       –   value to be added;
+ */
+static inline void stats_add(atomic_uint_least64_t* counter, uint64_t value) {
+    uint64_t old = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, old + value, memory_order_relaxed);
+}
+
+/** @brief Raise a counter written by a single thread to the value.
+ * @param[in,out] counter – pointer to the counter;
+ * @param[in] value       –   observed value;
+ */
+static inline void stats_max(atomic_uint_least64_t* counter, uint64_t value) {
+    if (atomic_load_explicit(counter, memory_order_relaxed) < value) {
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+    }
+}
+
+/** @brief Count a finished task.
+ * @param[in,out] stats – counters of the running worker;
+ * @param[in] enqueued  – time the task was deferred, @p 0 if it is not timed;
+ * @param[in] start     –    time the task started;
+ * @param[in] end       –   time the task finished;
+ */
+void stats_task(worker_stats_t* stats, uint64_t enqueued, uint64_t start, uint64_t end);
+
+/** @brief Add the counters to the public statistics.
+ * @param[in,out] into – accumulated statistics;
+ * @param[in] from     –  counters of a worker;
+ */
+void stats_collect(thread_pool_stats_t* into, const worker_stats_t* from);
+
+#endif // __STATS_H__
@@ -6,26 +6,98 @@
  * @date 12.02.2020
  */
 
+#define _GNU_SOURCE
+
 #include "threadpool.h"
+#include "deque.h"
+#include "futex.h"
+#include "ring.h"
+#include "stats.h"
+#include "timer.h"
+#include "topology.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/**
+ * Initial capacity of the deque of every thread.
+ */
+#define DEQUE_CAPACITY 256
+
+/**
+ * Number of queue nodes allocated at once.
+ */
+#define NODES_PER_CHUNK 64
+
+/**
+ * Default capacity of the ring buffer.
+ */
+#define RING_CAPACITY 1024
+
+/**
+ * Bit of ring_submitters set by destroy, rejecting new defers from outside.
+ */
+#define RING_CLOSED ((size_t) 1 << (sizeof(size_t) * CHAR_BIT - 1))
+
+/**
+ * Spin iterations between two looks into the queues.
+ */
+#define SPIN_CHECK_INTERVAL 16
+
+/**
+ * Number of tasks a thread takes from its own deque (or LIFO slot) in a row
+ * before it looks into the shared queues first.
+ */
+#define LOCAL_BUDGET 61
+
+/**
+ * Hint for the CPU that the thread is spinning.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void) 0)
+#endif
+
+/**
+ * Bounds of the sleep of a helping waiter between two looks into the queues.
+ */
+#define HELP_WAIT_MIN_NS 10000
+#define HELP_WAIT_MAX_NS 1000000
+
+/**
+ * Default time after which an idle extra thread of an elastic pool exits.
+ */
+#define KEEPALIVE_NS 1000000000ULL
+
+/**
+ * Number of pops every priority gets in one round of the weighted round-robin.
+ */
+static const unsigned priority_weights[THREAD_POOL_PRIORITIES] = {4, 2, 1};
 
 /** @brief Add a new element to the queue.
- * Allocate a new node and copy the runnable to it.
+ * Take a new node from the slab and copy the task to it.
  * Push it at the end of the queue.
  * @param[in,out] queue – pointer to the queue;
- * @param[in] runnable  – nowe dane do dołączenia do listy;
+ * @param[in] task      – nowe dane do dołączenia do listy;
  */
-static void push(queue_t* queue, runnable_t runnable) {
-    node_t* new = malloc(sizeof(node_t));
+static void push(queue_t* queue, const task_t* task) {
+    node_t* new = slab_alloc(&queue->nodes);
     if (new == NULL) {
         fprintf (stderr, "ERROR: node_create failed\n");
         exit(-1);
     }
 
-    new->runnable = runnable;
+    memcpy(&new->task, task, TASK_SIZE(task));
     new->next = NULL;
 
     if (queue->size == 0) {
@@ -41,41 +113,35 @@ static void push(queue_t* queue, runnable_t runnable) {
 
 /** @brief Read and pop the first element in queue.
  * Return the first element in the queue.
- * Pop the node from the queue and assign new first node.
+ * Pop the node from the queue, give it back to the slab
+ * and assign new first node.
  * @param[in,out] queue – pointer to the queue;
- * @return runnable with the first element in the queue.
+ * @param[out] task     – the first element in the queue;
  */
-static runnable_t pop(queue_t* queue) {
+static void pop(queue_t* queue, task_t* task) {
     if (queue->size == 0) {
         fprintf(stderr, "ERROR: pop from empty queue\n");
         exit(-1);
     }
 
-    runnable_t result = queue->first->runnable;
+    memcpy(task, &queue->first->task, TASK_SIZE(&queue->first->task));
     node_t* new_next = queue->first->next;
 
-    free(queue->first);
+    slab_free(&queue->nodes, queue->first);
     queue->first = new_next;
     --queue->size;
 
     if (queue->size == 0) {
         queue->last = NULL;
     }
-
-    return result;
 }
 
 /** @brief Deallocate the queue.
- * Iterate through every node in queue and free them.
+ * Every node lives in a chunk of the slab, so free the chunks.
  * @param[in,out] queue – pointer to the queue;
  */
 static void free_queue(queue_t* queue) {
-    node_t* node = queue->first;
-    while (node != NULL) {
-        node_t* tmp = node;
-        node = node->next;
-        free(tmp);
-    }
+    slab_destroy(&queue->nodes);
 }
 
 /**
@@ -137,61 +203,671 @@ static void destroy_handler() {
     free(handler.known_pools);
 }
 
+/**
+ * State of a single thread
+ */
+typedef struct worker {
+    deque_t deque; ///<           deque of tasks (work-stealing mode);
+    thread_pool_t* pool; ///<            pool the thread belongs to;
+    size_t index; ///<             index of the thread in the pool;
+    uint32_t seed; ///< state of the generator choosing the victims;
+    size_t spin_budget; ///<   spin iterations of the next idle period;
+    size_t local_streak; ///< tasks taken from the own deque in a row;
+    int node; ///<             NUMA node the thread is placed on;
+    int cpu; ///<        CPU the thread is pinned to, -1 if none;
+    int error; ///<             result of initializing the thread;
+    bool initial; ///<         information if started by init;
+    bool alive; ///<  information if the thread has to be joined;
+    bool retired; ///< information if the thread has exited;
+    atomic_bool ready; ///< information if the deque is initialized;
+    worker_stats_t stats; ///<              counters of the thread;
+} worker_t;
+
+/**
+ * Worker run by the current thread, @p NULL outside of the pools.
+ */
+static _Thread_local worker_t* current_worker = NULL;
+
+/**
+ * State of the generator choosing the shards for a thread outside of the pools.
+ */
+static _Thread_local uint32_t producer_seed = 0;
+
+/** @brief Draw a pseudo-random number (xorshift).
+ * @param[in,out] seed – state of the generator;
+ * @return Next number from the generator.
+ */
+static uint32_t next_random(uint32_t* seed) {
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return x;
+}
+
+/** @brief Count the tasks in the queues of all shards.
+ * @param[in] pool – pointer to the thread-pool;
+ * @return Number of queued tasks, possibly outdated.
+ */
+static size_t queued_tasks(thread_pool_t* pool) {
+    size_t queued = 0;
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        queued += atomic_load_explicit(&pool->shards[i].queued, memory_order_relaxed);
+    }
+    return queued;
+}
+
+/** @brief Pop the first task from the queues of the shard.
+ * Take the highest priority that still has credits in this round.
+ * @param[in,out] shard – pointer to the shard;
+ * @param[out] task     –   the popped task;
+ * @return @p 1, if a task was popped, @p 0 if the queue was empty.
+ * Negative value, if errors occurred.
+ */
+static int pop_shard(shard_t* shard, task_t* task) {
+    // Spinning and stealing threads look here often, don't take the mutex for nothing.
+    if (atomic_load_explicit(&shard->queued, memory_order_relaxed) == 0) {
+        return 0;
+    }
+    int err = sem_wait(&shard->mutex);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: sem_wait failed\n");
+        return -1;
+    }
+    // BEGIN CRITICAL SECTION
+
+    int found = 0;
+    for (int round = 0; round < 2 && found == 0; ++round) {
+        bool waiting = false;
+        for (int i = 0; i < THREAD_POOL_PRIORITIES; ++i) {
+            queue_t* queue = &shard->queues[i];
+            if (queue->size == 0) {
+                continue;
+            }
+            waiting = true;
+            if (shard->credits[i] > 0) {
+                --shard->credits[i];
+                pop(queue, task);
+                atomic_fetch_sub_explicit(&shard->queued, 1, memory_order_relaxed);
+                found = 1;
+                break;
+            }
+        }
+        if (!waiting) {
+            break;
+        }
+        if (found == 0) {
+            // Every waiting priority has used its credits, start a new round.
+            for (int i = 0; i < THREAD_POOL_PRIORITIES; ++i) {
+                shard->credits[i] = priority_weights[i];
+            }
+        }
+    }
+
+    // END CRITICAL SECTION
+    err = sem_post(&shard->mutex);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: sem_post failed\n");
+        return -1;
+    }
+
+    return found;
+}
+
+/** @brief Steal a task from other threads.
+ * Visit every other thread once, starting from a random victim.
+ * Threads on the same NUMA node are visited first, so their tasks
+ * (and the data they touch) stay on the node when possible.
+ * @param[in,out] worker – pointer to the worker;
+ * @param[out] task      –    the stolen task;
+ * @return @p true, if a task was stolen.
+ */
+static bool steal(worker_t* worker, task_t* task) {
+    thread_pool_t* pool = worker->pool;
+    size_t start = next_random(&worker->seed) % pool->pool_size;
+    for (int local = 1; local >= 0; --local) {
+        for (size_t i = 0; i < pool->pool_size; ++i) {
+            worker_t* victim = &pool->workers[(start + i) % pool->pool_size];
+            if (victim == worker || (victim->node == worker->node) != local
+                || !atomic_load_explicit(&victim->ready, memory_order_acquire)) {
+                continue;
+            }
+            deque_status_t status;
+            while ((status = deque_steal(&victim->deque, task)) == DEQUE_ABORT) {}
+            if (status == DEQUE_SUCCESS) {
+                stats_add(&worker->stats.steals, 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/** @brief Find a task for the worker.
+ * In the ring buffer mode pop from the ring.
+ * Otherwise look into the own deque first (in the shared and sharded
+ * queue modes it holds at most the task of the LIFO slot), then into
+ * the home shard of the queues and the other shards, then steal from
+ * the others. After LOCAL_BUDGET tasks from the own deque in a row the
+ * shards go first, so a task deferring itself again and again does not
+ * starve the queued tasks (and their priorities).
+ * @param[in,out] worker – pointer to the worker;
+ * @param[out] task      –     the found task;
+ * @return @p 1, if a task was found, @p 0 if there were no tasks.
+ * Negative value, if errors occurred.
+ */
+static int find_task(worker_t* worker, task_t* task) {
+    thread_pool_t* pool = worker->pool;
+    if (pool->mode == THREAD_POOL_RING_BUFFER) {
+        return ring_pop(pool->ring, task);
+    }
+    bool local_first = worker->local_streak < LOCAL_BUDGET;
+    if (local_first && deque_take(&worker->deque, task)) {
+        ++worker->local_streak;
+        return 1;
+    }
+
+    worker->local_streak = 0;
+    size_t home = worker->index % pool->shards_count;
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        int found = pop_shard(&pool->shards[(home + i) % pool->shards_count], task);
+        if (found != 0) {
+            return found;
+        }
+    }
+    if (!local_first && deque_take(&worker->deque, task)) {
+        ++worker->local_streak;
+        return 1;
+    }
+
+    if (steal(worker, task)) {
+        return 1;
+    }
+    return 0;
+}
+
+/** @brief Wake up sleeping threads.
+ * Every woken thread is claimed by decrementing the sleeping counter,
+ * so a single sleeper is never posted twice. Threads that are spinning
+ * will find the tasks themselves, so as many fewer sleepers are woken.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[in] count    – maximal number of threads to wake;
+ * @return @p 0, if threads were woken correctly.
+ * Non-zero value, if errors occurred.
+ */
+static int wake_threads(thread_pool_t* pool, size_t count) {
+    // Pairs with the fence in park, so either the sleeper sees the new task
+    // or we see the sleeper.
+    atomic_thread_fence(memory_order_seq_cst);
+    // Every spinning thread will take one of the tasks.
+    size_t spinning = atomic_load_explicit(&pool->spinning, memory_order_relaxed);
+    count = count > spinning ? count - spinning : 0;
+    size_t sleeping = atomic_load_explicit(&pool->sleeping, memory_order_relaxed);
+    while (count > 0 && sleeping > 0) {
+        if (atomic_compare_exchange_weak(&pool->sleeping, &sleeping, sleeping - 1)) {
+            int err = sem_post(&pool->waiting_threads);
+            if (err != 0) {
+                fprintf(stderr, "ERROR: sem_post failed\n");
+                return err;
+            }
+            --count;
+            --sleeping;
+        }
+    }
+    return 0;
+}
+
+/** @brief Wake every sleeping thread when the last delayed task is deferred.
+ * Called by the timer thread of a finishing pool, so the threads waiting
+ * for delayed tasks see that there are none left and exit.
+ * @param[in,out] pool – pointer to the thread-pool;
+ */
+static void timer_drained(thread_pool_t* pool) {
+    wake_threads(pool, pool->pool_size);
+}
+
+/** @brief Check if the threads of the pool can exit when they find no task.
+ * The pool has to be finished and the timer must not hold one-shot tasks,
+ * which running tasks may still add during destroy.
+ * @param[in] pool – pointer to the thread-pool;
+ * @return @p true, if no more tasks can come.
+ */
+static bool pool_finished(thread_pool_t* pool) {
+    return atomic_load(&pool->finished) && atomic_load(&pool->timer->one_shot) == 0;
+}
+
+/**
+ * Result of park when an extra thread was idle for the keepalive time.
+ */
+#define PARK_IDLE 2
+
+/** @brief Remove one registration from the sleeping counter.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @return @p true, if unregistered, @p false if all sleepers were already claimed.
+ */
+static bool unregister_sleeper(thread_pool_t* pool) {
+    size_t sleeping = atomic_load(&pool->sleeping);
+    while (sleeping > 0) {
+        if (atomic_compare_exchange_weak(&pool->sleeping, &sleeping, sleeping - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** @brief Sleep on the semaphore of the pool.
+ * Threads of an elastic pool sleep at most keepalive_ns, measured on
+ * CLOCK_MONOTONIC, so a change of the system time does not affect it.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @return @p 0, if woken, @p ETIMEDOUT if the keepalive has passed.
+ * Negative value, if errors occurred.
+ */
+static int sleep_on_pool(thread_pool_t* pool) {
+    if (pool->min_threads == pool->pool_size) {
+        if (sem_wait(&pool->waiting_threads) != 0) {
+            fprintf(stderr, "ERROR: sem_wait failed\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nsec = deadline.tv_nsec + pool->keepalive_ns;
+    deadline.tv_sec += nsec / 1000000000ULL;
+    deadline.tv_nsec = nsec % 1000000000ULL;
+    while (sem_clockwait(&pool->waiting_threads, CLOCK_MONOTONIC, &deadline) != 0) {
+        if (errno == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+        if (errno != EINTR) {
+            fprintf(stderr, "ERROR: sem_clockwait failed\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Put the worker to sleep until a new task arrives.
+ * The worker registers as sleeping and looks for a task once more
+ * before sleeping on the semaphore, so no wake-up can be lost.
+ * @param[in,out] worker – pointer to the worker;
+ * @param[out] task      – task found after the registration;
+ * @return @p 1, if a task was found, @p 0 if the worker was woken up,
+ * @p PARK_IDLE if nothing woke the worker for the keepalive time.
+ * Negative value, if errors occurred.
+ */
+static int park(worker_t* worker, task_t* task) {
+    thread_pool_t* pool = worker->pool;
+    atomic_fetch_add(&pool->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Read finished before looking for tasks: every task deferred
+    // before the pool was finished is visible after that.
+    bool finished = pool_finished(pool);
+    int found = find_task(worker, task);
+    if (found != 0 || finished) {
+        if (unregister_sleeper(pool)) {
+            return found;
+        }
+        // Somebody has already claimed us, consume the post.
+    }
+
+    int err = sleep_on_pool(pool);
+    if (err == ETIMEDOUT) {
+        if (unregister_sleeper(pool)) {
+            return found != 0 ? found : PARK_IDLE;
+        }
+        // Claimed right after the timeout, the post is on its way.
+        while ((err = sleep_on_pool(pool)) == ETIMEDOUT) {}
+    }
+    return err < 0 ? err : found;
+}
+
+/** @brief Let an idle extra thread exit.
+ * @param[in,out] worker – pointer to the worker;
+ * @return @p true, if the thread has to exit, @p false if the pool needs it.
+ */
+static bool retire(worker_t* worker) {
+    thread_pool_t* pool = worker->pool;
+    if (sem_wait(&pool->mutex) != 0) {
+        fprintf(stderr, "ERROR: sem_wait failed\n");
+        return false;
+    }
+    // BEGIN CRITICAL SECTION
+
+    bool retired = !atomic_load(&pool->finished)
+                   && atomic_load(&pool->threads_count) > pool->min_threads;
+    if (retired) {
+        // Leave first, then look at the queues: a task deferred after the check
+        // sees the smaller number of threads in grow and spawns a new one.
+        atomic_fetch_sub(&pool->threads_count, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        size_t backlog = queued_tasks(pool);
+        if (pool->ring != NULL) {
+            size_t dequeued = atomic_load(&pool->ring->dequeue_pos);
+            backlog += atomic_load(&pool->ring->enqueue_pos) - dequeued;
+        }
+        if (backlog > 0) {
+            atomic_fetch_add(&pool->threads_count, 1);
+            retired = false;
+        }
+    }
+    worker->retired = retired;
+
+    // END CRITICAL SECTION
+    if (sem_post(&pool->mutex) != 0) {
+        fprintf(stderr, "ERROR: sem_post failed\n");
+    }
+    return retired;
+}
+
+/** @brief Look for a task for a while before parking.
+ * The thread spins with a pause instruction, then yields the CPU a few times,
+ * looking into the queues every few iterations. While it spins, submitters
+ * wake one sleeper fewer. The number of spin iterations adapts: it is halved
+ * after every idle period that found nothing and reset after a successful one.
+ * @param[in,out] worker – pointer to the worker;
+ * @param[out] task      –     the found task;
+ * @return @p 1, if a task was found, @p 0 if there were no tasks.
+ * Negative value, if errors occurred.
+ */
+static int spin(worker_t* worker, task_t* task) {
+    thread_pool_t* pool = worker->pool;
+    if (worker->spin_budget == 0 && pool->yield_count == 0) {
+        return 0;
+    }
+    atomic_fetch_add(&pool->spinning, 1);
+
+    int found = 0;
+    for (size_t i = 1; i <= worker->spin_budget && found == 0; ++i) {
+        cpu_relax();
+        if (i % SPIN_CHECK_INTERVAL == 0) {
+            found = find_task(worker, task);
+        }
+    }
+    for (size_t i = 0; i < pool->yield_count && found == 0; ++i) {
+        sched_yield();
+        found = find_task(worker, task);
+    }
+
+    // Stop spinning before looking at the queues once more: a submitter that
+    // has seen us spinning did not wake anybody, so its task has to be passed on.
+    atomic_fetch_sub(&pool->spinning, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (found > 0) {
+        worker->spin_budget = pool->spin_count;
+        bool more = queued_tasks(pool) > 0;
+        if (pool->ring != NULL) {
+            size_t dequeued = atomic_load(&pool->ring->dequeue_pos);
+            more = atomic_load(&pool->ring->enqueue_pos) != dequeued;
+        }
+        if (more && wake_threads(pool, 1) != 0) {
+            return -1;
+        }
+    } else if (found == 0) {
+        worker->spin_budget /= 2;
+    }
+    return found;
+}
+
+/** @brief Give back the space of started (or rejected) tasks of a bounded pool.
+ * Producers waiting for space are woken only if there are any.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[in] count    –  number of the tasks;
+ */
+static void release_space(thread_pool_t* pool, size_t count) {
+    atomic_fetch_sub(&pool->pending, count);
+    // Pairs with the registration in admit: either the waiter sees the space or we see the waiter.
+    if (atomic_load(&pool->space_waiters) > 0) {
+        atomic_fetch_add(&pool->space, 1);
+        futex_wake(&pool->space, INT_MAX);
+    }
+}
+
+/** @brief Take space for the tasks in a bounded pool.
+ * The tasks fit if the pool is empty (so a batch bigger than the bound is
+ * accepted alone) or if they don't exceed the bound. Threads of the pool
+ * never wait for space: all of them could wait for each other. They are
+ * not limited by the bound, so only the ring buffer can reject their tasks.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[in] count    –  number of the tasks;
+ * @param[in] internal – information if called by a thread of the pool;
+ * @param[in] block    – information if the caller waits for space;
+ * @param[in] deadline – absolute CLOCK_MONOTONIC time, @p NULL for no limit;
+ * @return @p 0, if the space was taken, @p EAGAIN if the pool is full and
+ * the caller does not wait, @p ETIMEDOUT if the deadline passed.
+ */
+static int admit(thread_pool_t* pool, size_t count, bool internal, bool block,
+                 const struct timespec* deadline) {
+    size_t pending = atomic_load(&pool->pending);
+    while (true) {
+        if ((internal && block) || pending == 0 || pending + count <= pool->max_queued) {
+            if (atomic_compare_exchange_weak(&pool->pending, &pending, pending + count)) {
+                return 0;
+            }
+            continue;
+        }
+        if (!block) {
+            return EAGAIN;
+        }
+
+        atomic_fetch_add(&pool->space_waiters, 1);
+        int space = atomic_load(&pool->space);
+        pending = atomic_load(&pool->pending);
+        int err = 0;
+        if (pending != 0 && pending + count > pool->max_queued) {
+            err = futex_wait(&pool->space, space, deadline);
+        }
+        atomic_fetch_sub(&pool->space_waiters, 1);
+        if (err == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+        pending = atomic_load(&pool->pending);
+    }
+}
+
+/** @brief Run the found task and count it.
+ * A task with a cancelled token is dropped without running.
+ * @param[in,out] worker – pointer to the worker;
+ * @param[in] task       –  task to be run;
+ * @param[in] now        – time the previous task finished, @p 0 if unknown;
+ * @return Time the task finished, @p 0 if it was not timed.
+ */
+static uint64_t run_task(worker_t* worker, task_t* task, uint64_t now) {
+    if (worker->pool->max_queued > 0) {
+        release_space(worker->pool, 1);
+    }
+    if (cancel_requested(task->runnable.token)) {
+        // Cancelled before it started, drop it without running.
+        stats_add(&worker->stats.cancelled, 1);
+        return now;
+    }
+    void* task_arg = task->inline_size > 0 ? task->storage : task->runnable.arg;
+    if (task->enqueued == 0) {
+        (*task->runnable.function)(task_arg, task->runnable.argsz);
+        stats_task(&worker->stats, 0, 0, 0);
+        return 0;
+    }
+    // A task taken right after the previous one starts when that one finished,
+    // so a busy thread reads the clock once per task.
+    uint64_t start = now != 0 ? now : stats_clock_ns();
+    (*task->runnable.function)(task_arg, task->runnable.argsz);
+    now = stats_clock_ns();
+    stats_task(&worker->stats, task->enqueued, start, now);
+    return now;
+}
+
+/** @brief Wait until every thread of the pool is initialized.
+ * Called once by every thread and by thread_pool_init_with.
+ * @param[in,out] pool – pointer to the thread-pool;
+ */
+static void wait_for_startup(thread_pool_t* pool) {
+    if (atomic_fetch_sub(&pool->starting, 1) == 1) {
+        futex_wake(&pool->starting, INT_MAX);
+        return;
+    }
+    int starting;
+    while ((starting = atomic_load(&pool->starting)) != 0) {
+        futex_wait(&pool->starting, starting, NULL);
+    }
+}
+
 /** @brief Function run by every thread.
- * If there is a task to run pop it from the queue and run.
+ * If there is a task to run, take it and run.
  * If not, sleep on the semaphore.
- * Repeat until the thread-pool is destroyed.
+ * Repeat until the thread-pool is destroyed and all tasks are done.
  */
 static void* thread_function(void* arg) {
     pthread_sigmask(SIG_BLOCK, &handler.block_mask, NULL);
-    thread_pool_t* pool = arg;
+    worker_t* worker = arg;
+    thread_pool_t* pool = worker->pool;
+    current_worker = worker;
     int* err = malloc(sizeof(int));
-    while (true) {
-        *err = sem_wait(&pool->waiting_threads);
-        if (*err != 0) {
-            fprintf(stderr, "ERROR: sem_wait failed\n");
-            return err;
-        }
+    *err = 0;
 
-        *err = sem_wait(&pool->mutex);
-        if (*err != 0) {
-            fprintf(stderr, "ERROR: sem_wait failed\n");
-            return err;
-        }
-        // BEGIN CRITICAL SECTION
+    // The deque is allocated by its owner, already running on its CPU,
+    // so its memory is placed on the node of the thread (first touch).
+    // A thread spawned in a reused slot keeps the deque of its predecessor.
+    if (!atomic_load(&worker->ready)) {
+        worker->error = deque_init(&worker->deque, DEQUE_CAPACITY);
+        atomic_store_explicit(&worker->ready, worker->error == 0, memory_order_release);
+    }
+    if (worker->initial) {
+        // Threads spawned later in this slot do not take part in the startup.
+        worker->initial = false;
+        wait_for_startup(pool);
+    }
+    if (worker->error != 0) {
+        *err = worker->error;
+        return err;
+    }
 
-        if (pool->queue->size == 0) {
-            *err = sem_post(&pool->mutex);
-            if (*err != 0) {
-                fprintf(stderr, "ERROR: sem_post failed\n");
+    // Time the previous task finished, 0 if the thread has been idle since.
+    uint64_t now = 0;
+    while (true) {
+        task_t task;
+        bool finished = pool_finished(pool);
+        int found = find_task(worker, &task);
+        if (found == 0) {
+            now = 0;
+            if (finished) {
                 return err;
             }
-            *err = 0;
-            return err;
+            found = spin(worker, &task);
         }
-        runnable_t task = pop(pool->queue);
-
-        // END CRITICAL SECTION
-        *err = sem_post(&pool->mutex);
-        if (*err != 0) {
-            fprintf(stderr, "ERROR: sem_post failed\n");
+        if (found == 0) {
+            found = park(worker, &task);
+            if (found == PARK_IDLE) {
+                found = find_task(worker, &task);
+                if (found == 0 && retire(worker)) {
+                    return err;
+                }
+            }
+        }
+        if (found < 0) {
+            *err = found;
             return err;
         }
-
-        (*task.function)(task.arg, task.argsz);
+        if (found > 0) {
+            now = run_task(worker, &task, now);
+        }
     }
 }
 
+void thread_pool_options_init(thread_pool_options_t* options, size_t pool_size) {
+    options->pool_size = pool_size;
+    options->mode = THREAD_POOL_SHARED_QUEUE;
+    options->capacity = RING_CAPACITY;
+    options->shards = 0;
+    options->max_queued = 0;
+    options->placement = THREAD_POOL_PLACEMENT_NONE;
+    options->cpus = NULL;
+    options->cpus_count = 0;
+    options->max_pool_size = 0;
+    options->grow_backlog = 1;
+    options->keepalive_ns = KEEPALIVE_NS;
+    options->spin_count = 0;
+    options->yield_count = 0;
+    options->timing = true;
+}
+
 int thread_pool_init(thread_pool_t* pool, size_t num_threads) {
-    // INIT QUEUE
-    pool->queue = malloc(sizeof(queue_t));
-    if (pool->queue == NULL) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, num_threads);
+    return thread_pool_init_with(pool, &options);
+}
+
+int thread_pool_init_with(thread_pool_t* pool, const thread_pool_options_t* options) {
+    size_t num_threads = options->pool_size;
+    size_t max_threads = options->max_pool_size > 0 ? options->max_pool_size : num_threads;
+    if (max_threads < num_threads || (max_threads > num_threads && num_threads == 0)) {
+        fprintf(stderr, "ERROR: elastic pool needs 1 <= pool_size <= max_pool_size\n");
+        return -1;
+    }
+    pool->mode = options->mode;
+
+    // INIT PLACEMENT
+    // First, so invalid CPUs are rejected before anything is allocated.
+    topology_t topology = {.cpus_count = 0};
+    if (options->placement != THREAD_POOL_PLACEMENT_NONE
+        && topology_init(&topology, options->cpus, options->cpus_count, options->placement) != 0) {
+        return -1;
+    }
+
+    // INIT QUEUES
+    pool->shards_count = 1;
+    if (pool->mode == THREAD_POOL_SHARDED_QUEUES) {
+        pool->shards_count = options->shards > 0 ? options->shards : num_threads;
+        pool->shards_count = pool->shards_count > 0 ? pool->shards_count : 1;
+    }
+    pool->shards = aligned_alloc(alignof(shard_t), pool->shards_count * sizeof(shard_t));
+    if (pool->shards == NULL) {
         fprintf(stderr, "ERROR: queue_create failed\n");
         return -1;
     }
-    pool->queue->size = 0;
-    pool->queue->first = NULL;
-    pool->queue->last = NULL;
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        shard_t* shard = &pool->shards[i];
+        if (sem_init(&shard->mutex, 0, 1) != 0) {
+            fprintf(stderr, "ERROR: sem_init failed\n");
+            return -1;
+        }
+        atomic_init(&shard->queued, 0);
+        atomic_init(&shard->submitted, 0);
+        atomic_init(&shard->max_queue_depth, 0);
+        for (int j = 0; j < THREAD_POOL_PRIORITIES; ++j) {
+            queue_t* queue = &shard->queues[j];
+            queue->size = 0;
+            queue->first = NULL;
+            queue->last = NULL;
+            slab_init(&queue->nodes, sizeof(node_t), NODES_PER_CHUNK);
+            shard->credits[j] = priority_weights[j];
+        }
+    }
+
+    // INIT RING
+    pool->ring = NULL;
+    atomic_init(&pool->ring_submitters, 0);
+    if (pool->mode == THREAD_POOL_RING_BUFFER) {
+        size_t capacity = 2;
+        // A bounded pool waits for space before the ring is full.
+        while (capacity < options->capacity || capacity < options->max_queued) {
+            capacity *= 2;
+        }
+        pool->ring = aligned_alloc(alignof(ring_t), sizeof(ring_t));
+        if (pool->ring == NULL || ring_init(pool->ring, capacity) != 0) {
+            fprintf(stderr, "ERROR: ring_create failed\n");
+            return -1;
+        }
+    }
+
+    // INIT TIMER
+    pool->timer = malloc(sizeof(timer_wheel_t));
+    if (pool->timer == NULL || timer_init(pool->timer, pool, timer_drained) != 0) {
+        fprintf(stderr, "ERROR: timer_create failed\n");
+        return -1;
+    }
 
     // INIT SEMAPHORES
     int err = sem_init(&pool->mutex, 0, 1);
@@ -205,6 +881,18 @@ int thread_pool_init(thread_pool_t* pool, size_t num_threads) {
         fprintf(stderr, "ERROR: sem_init failed\n");
         return -1;
     }
+    atomic_init(&pool->sleeping, 0);
+    atomic_init(&pool->spinning, 0);
+    pool->max_queued = options->max_queued;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->space_waiters, 0);
+    atomic_init(&pool->space, 0);
+    pool->spin_count = options->spin_count;
+    pool->yield_count = options->yield_count;
+    pool->timing = options->timing;
+
+    // INIT FINISHED
+    atomic_init(&pool->finished, false);
 
     // INIT ATTRIBUTE
     err = pthread_attr_init(&pool->attr);
@@ -219,23 +907,67 @@ int thread_pool_init(thread_pool_t* pool, size_t num_threads) {
         return err;
     }
 
-    // INIT THREADS
-    pool->pool_size = num_threads;
+    // INIT WORKERS
+    // Slots for all threads the pool can ever have, the first num_threads are started now.
+    pool->pool_size = max_threads;
+    pool->min_threads = num_threads;
+    atomic_init(&pool->threads_count, num_threads);
+    pool->grow_backlog = options->grow_backlog;
+    pool->keepalive_ns = options->keepalive_ns;
+
+    pool->workers = aligned_alloc(alignof(worker_t), max_threads * sizeof(worker_t));
+    if (pool->workers == NULL) {
+        fprintf(stderr, "ERROR: workers array malloc failed\n");
+        return -1;
+    }
+
+    atomic_init(&pool->starting, (int) num_threads + 1);
+    for (unsigned i = 0; i < max_threads; ++i) {
+        worker_t* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->seed = 2654435761u * (i + 1);
+        worker->spin_budget = options->spin_count;
+        worker->local_streak = 0;
+        stats_init(&worker->stats);
+        worker->node = topology.cpus_count > 0 ? topology.nodes[i % topology.cpus_count] : 0;
+        worker->cpu = topology.cpus_count > 0 ? topology.cpus[i % topology.cpus_count] : -1;
+        worker->error = 0;
+        worker->initial = i < num_threads;
+        worker->alive = i < num_threads;
+        worker->retired = false;
+        atomic_init(&worker->ready, false);
+    }
 
-    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    // INIT THREADS
+    pool->threads = malloc(max_threads * sizeof(pthread_t));
     if (pool->threads == NULL) {
         fprintf(stderr, "ERROR: threads array malloc failed\n");
         return -1;
     }
 
     for (unsigned i = 0; i < num_threads; ++i) {
-        err = pthread_create(&pool->threads[i], &pool->attr, thread_function, pool);
+        if (pool->workers[i].cpu >= 0 && topology_pin(&pool->attr, pool->workers[i].cpu) != 0) {
+            return -1;
+        }
+        err = pthread_create(&pool->threads[i], &pool->attr, thread_function, &pool->workers[i]);
         if (err != 0) {
             fprintf(stderr, "ERROR: pthread_create failed\n");
             return err;
         }
     }
 
+    // Wait until every thread has initialized its deque.
+    wait_for_startup(pool);
+    if (topology.cpus_count > 0) {
+        topology_destroy(&topology);
+    }
+    for (unsigned i = 0; i < num_threads; ++i) {
+        if (pool->workers[i].error != 0) {
+            return -1;
+        }
+    }
+
     if (handler.last == handler.pools_size) {
         thread_pool_t** new_pools = realloc(handler.known_pools,
                 2 * handler.pools_size * sizeof(thread_pool_t*));
@@ -247,9 +979,6 @@ int thread_pool_init(thread_pool_t* pool, size_t num_threads) {
     }
     handler.known_pools[handler.last++] = pool;
 
-    // INIT FINISHED
-    pool->finished = false;
-
     return 0;
 }
 
@@ -260,27 +989,56 @@ void thread_pool_destroy(thread_pool_t* pool) {
             break;
         }
     }
+    // Delayed tasks still reach the queues: the threads exit only
+    // when the timer has no one-shot tasks left.
+    timer_finish(pool->timer);
+
+    // The ring has no lock: close it and wait for the defers in progress,
+    // so their tasks are in the ring before finished is set.
+    if (pool->ring != NULL) {
+        atomic_fetch_or(&pool->ring_submitters, RING_CLOSED);
+        while (atomic_load(&pool->ring_submitters) != RING_CLOSED) {
+            sched_yield();
+        }
+    }
+
+    // Under every lock: a task deferred from outside either is in a queue
+    // before finished is set or sees it and is rejected.
     int err = sem_wait(&pool->mutex);
+    for (size_t i = 0; i < pool->shards_count && err == 0; ++i) {
+        err = sem_wait(&pool->shards[i].mutex);
+    }
     if (err != 0) {
         fprintf(stderr, "ERROR: sem_wait failed\n");
         exit(err);
     }
     // BEGIN CRITICAL SECTION
 
-    pool->finished = true;
-    for (unsigned i = 0; i < pool->pool_size + pool->queue->size; ++i) {
-        sem_post(&pool->waiting_threads);
-    }
+    atomic_store(&pool->finished, true);
 
     // END CRITICAL SECTION
-    err = sem_post(&pool->mutex);
+    for (size_t i = 0; i < pool->shards_count && err == 0; ++i) {
+        err = sem_post(&pool->shards[i].mutex);
+    }
+    if (err == 0) {
+        err = sem_post(&pool->mutex);
+    }
     if (err != 0) {
         fprintf(stderr, "ERROR: sem_post failed\n");
         exit(err);
     }
 
+    err = wake_threads(pool, pool->pool_size);
+    if (err != 0) {
+        exit(err);
+    }
+
     void* retval;
     for (unsigned i = 0; i < pool->pool_size; ++i) {
+        // No thread is spawned after finished is set.
+        if (!pool->workers[i].alive) {
+            continue;
+        }
         pthread_join(pool->threads[i], &retval);
         int* ret = retval;
         if (*ret != 0) {
@@ -290,6 +1048,9 @@ void thread_pool_destroy(thread_pool_t* pool) {
         }
         free(ret);
     }
+    // Running tasks could add delayed tasks until now.
+    timer_destroy(pool->timer);
+    free(pool->timer);
 
     err = pthread_attr_destroy(&pool->attr);
     if (err != 0) {
@@ -308,14 +1069,44 @@ void thread_pool_destroy(thread_pool_t* pool) {
         exit(-1);
     }
 
-    free_queue(pool->queue);
-    free(pool->queue);
+    for (unsigned i = 0; i < pool->pool_size; ++i) {
+        if (atomic_load(&pool->workers[i].ready)) {
+            deque_destroy(&pool->workers[i].deque);
+        }
+    }
+    free(pool->workers);
+    if (pool->ring != NULL) {
+        ring_destroy(pool->ring);
+        free(pool->ring);
+    }
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        sem_destroy(&pool->shards[i].mutex);
+        for (int j = 0; j < THREAD_POOL_PRIORITIES; ++j) {
+            free_queue(&pool->shards[i].queues[j]);
+        }
+    }
+    free(pool->shards);
     free(pool->threads);
 
 
 }
 
-int defer(struct thread_pool* pool, runnable_t runnable) {
+/** @brief Spawn a new thread if the tasks are queueing up.
+ * Only elastic pools grow, when no thread is idle, the backlog has reached
+ * grow_backlog and there are free slots. A slot left by a retired thread is
+ * reused after joining its thread.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[in] backlog  –  number of queued tasks;
+ * @return @p 0, if the pool was grown or did not have to grow.
+ * Non-zero value, if errors occurred.
+ */
+static int grow(thread_pool_t* pool, size_t backlog) {
+    if (pool->min_threads == pool->pool_size || backlog < pool->grow_backlog
+        || atomic_load(&pool->sleeping) > 0
+        || atomic_load(&pool->threads_count) == pool->pool_size) {
+        return 0;
+    }
+
     int err = sem_wait(&pool->mutex);
     if (err != 0) {
         fprintf(stderr, "ERROR: sem_wait failed\n");
@@ -323,21 +1114,514 @@ int defer(struct thread_pool* pool, runnable_t runnable) {
     }
     // BEGIN CRITICAL SECTION
 
-    if (pool->finished) { return -1; }
-    push(pool->queue, runnable);
+    if (!atomic_load(&pool->finished) && atomic_load(&pool->threads_count) < pool->pool_size) {
+        size_t i = 0;
+        while (pool->workers[i].alive && !pool->workers[i].retired) {
+            ++i;
+        }
+        worker_t* worker = &pool->workers[i];
+        if (worker->alive) {
+            void* retval;
+            pthread_join(pool->threads[i], &retval);
+            free(retval);
+        }
+        // Threads are created under the mutex, so destroy sees every one of them.
+        if (worker->cpu >= 0) {
+            err = topology_pin(&pool->attr, worker->cpu);
+        }
+        worker->alive = false;
+        worker->retired = false;
+        if (err == 0) {
+            err = pthread_create(&pool->threads[i], &pool->attr, thread_function, worker);
+            if (err != 0) {
+                fprintf(stderr, "ERROR: pthread_create failed\n");
+            }
+        }
+        if (err == 0) {
+            worker->alive = true;
+            atomic_fetch_add(&pool->threads_count, 1);
+        }
+    }
 
     // END CRITICAL SECTION
-    err = sem_post(&pool->mutex);
+    if (sem_post(&pool->mutex) != 0) {
+        fprintf(stderr, "ERROR: sem_post failed\n");
+        return -1;
+    }
+    return err;
+}
+
+/**
+ * Tasks passed to submit: either runnables or inline arguments.
+ */
+typedef struct task_source {
+    const runnable_t* runnables; ///<     array of runnables or @p NULL;
+    void (*function)(void*, size_t); ///< function of the inline tasks;
+    const unsigned char* args; ///<     inline arguments of the tasks;
+    size_t argsz; ///<           size of the arguments of one task;
+} task_source_t;
+
+/** @brief Build the i-th task of the source.
+ * Only the header and the used part of the storage are written.
+ * @param[in] source – tasks passed to submit;
+ * @param[in] i      –    index of the task;
+ * @param[out] task  –       the built task;
+ */
+static void source_get(const task_source_t* source, size_t i, task_t* task) {
+    if (source->runnables != NULL) {
+        task->runnable = source->runnables[i];
+        task->inline_size = 0;
+        return;
+    }
+    task->runnable.function = source->function;
+    task->runnable.arg = NULL;
+    task->runnable.argsz = source->argsz;
+    task->runnable.token = NULL;
+    task->inline_size = source->argsz;
+    memcpy(task->storage, source->args + i * source->argsz, source->argsz);
+}
+
+/** @brief Count the deferred tasks in the statistics.
+ * Workers count in their own counters. Other threads count in the counters
+ * of the shard they deferred to, under its lock, except in the ring buffer
+ * mode, which has no lock and counts in the first shard.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] worker    – worker of the current thread, @p NULL if external;
+ * @param[in] count     –             number of deferred tasks;
+ * @param[in] backlog   – number of queued tasks after deferring;
+ */
+static void count_submitted(thread_pool_t* pool, worker_t* worker, size_t count, size_t backlog) {
+    if (worker != NULL) {
+        stats_add(&worker->stats.submitted, count);
+        stats_max(&worker->stats.max_queue_depth, backlog);
+        return;
+    }
+    shard_t* shard = &pool->shards[0];
+    atomic_fetch_add_explicit(&shard->submitted, count, memory_order_relaxed);
+    uint64_t depth = atomic_load_explicit(&shard->max_queue_depth, memory_order_relaxed);
+    while (depth < backlog
+           && !atomic_compare_exchange_weak_explicit(&shard->max_queue_depth, &depth, backlog,
+                                                     memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+/** @brief Choose the shard of the queues for the deferred tasks.
+ * A thread of the pool uses its home shard. Another thread draws two shards
+ * and takes the one with fewer tasks, which keeps the shards balanced
+ * without looking at all of them.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] worker    – worker of the current thread, @p NULL if external;
+ * @return Pointer to the chosen shard.
+ */
+static shard_t* choose_shard(thread_pool_t* pool, worker_t* worker) {
+    if (pool->shards_count == 1) {
+        return &pool->shards[0];
+    }
+    if (worker != NULL) {
+        return &pool->shards[worker->index % pool->shards_count];
+    }
+    if (producer_seed == 0) {
+        // Different threads start from different states.
+        producer_seed = (uint32_t) ((uintptr_t) &producer_seed >> 4) * 2654435761u | 1;
+    }
+    uint32_t random = next_random(&producer_seed);
+    shard_t* first = &pool->shards[(random & 0xffff) % pool->shards_count];
+    shard_t* second = &pool->shards[(random >> 16) % pool->shards_count];
+    size_t first_queued = atomic_load_explicit(&first->queued, memory_order_relaxed);
+    size_t second_queued = atomic_load_explicit(&second->queued, memory_order_relaxed);
+    return first_queued <= second_queued ? first : second;
+}
+
+/** @brief Put the task spawned inside the pool into the LIFO slot of the thread.
+ * The slot is the deque of the worker holding at most one task, so the
+ * worker runs the newest task next, while its data is still in the cache,
+ * and idle threads can still steal it. A task already in the slot is moved
+ * to the home shard of the queues, the only case that takes a lock.
+ * @param[in,out] worker  – worker of the current thread;
+ * @param[in] source      – the task to be added;
+ * @param[out] deferred   – set to @p 1 once the task is in the slot;
+ * @return @p 0, if the task was deferred correctly.
+ * Non-zero value, if errors occurred.
+ */
+static int submit_local(worker_t* worker, const task_source_t* source, size_t* deferred) {
+    thread_pool_t* pool = worker->pool;
+    task_t task;
+    task_t previous;
+    task.enqueued = pool->timing ? stats_clock_ns() : 0;
+    source_get(source, 0, &task);
+    bool replaced = deque_take(&worker->deque, &previous);
+    int err = deque_push(&worker->deque, &task);
+    if (err != 0) {
+        return err;
+    }
+    *deferred = 1;
+    if (!replaced) {
+        count_submitted(pool, worker, 1, 1);
+        return wake_threads(pool, 1);
+    }
+
+    shard_t* shard = &pool->shards[worker->index % pool->shards_count];
+    err = sem_wait(&shard->mutex);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: sem_wait failed\n");
+        return err;
+    }
+    // BEGIN CRITICAL SECTION
+
+    push(&shard->queues[THREAD_POOL_PRIORITY_NORMAL], &previous);
+    atomic_fetch_add_explicit(&shard->queued, 1, memory_order_relaxed);
+    size_t backlog = 1;
+    for (int i = 0; i < THREAD_POOL_PRIORITIES; ++i) {
+        backlog += shard->queues[i].size;
+    }
+
+    // END CRITICAL SECTION
+    err = sem_post(&shard->mutex);
     if (err != 0) {
         fprintf(stderr, "ERROR: sem_post failed\n");
         return err;
     }
 
-    err = sem_post(&pool->waiting_threads);
+    count_submitted(pool, worker, 1, backlog);
+    err = wake_threads(pool, 1);
+    if (err != 0) {
+        return err;
+    }
+    return grow(pool, backlog);
+}
+
+/** @brief Add the tasks to the pool.
+ * Shared implementation of all defer variants.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] source    –     tasks to be added;
+ * @param[in] count     –       number of tasks;
+ * @param[in] priority  –   priority of the tasks;
+ * @param[in] block     – information if the caller waits for space;
+ * @param[in] deadline  – end of the wait for space, @p NULL for no limit;
+ * @param[out] deferred – number of the first tasks that were deferred,
+ *                        also when an error is returned;
+ * @return @p 0, if every task was deferred correctly, @p EAGAIN if there is
+ * no space and the caller does not wait, @p ETIMEDOUT if the deadline passed.
+ * Other non-zero value, if errors occurred.
+ */
+static int submit(thread_pool_t* pool, const task_source_t* source, size_t count,
+                  thread_pool_priority_t priority, bool block, const struct timespec* deadline,
+                  size_t* deferred) {
+    *deferred = 0;
+    if (count == 0) {
+        return 0;
+    }
+
+    // Tasks deferred by running tasks are accepted even when the pool is
+    // being destroyed: the deferring thread finds them before it exits.
+    // So are due delayed tasks: the threads wait for the timer.
+    worker_t* worker = current_worker;
+    bool internal = worker != NULL && worker->pool == pool;
+    bool late = internal || timer_is_current(pool->timer);
+    worker_t* counting = internal ? worker : NULL;
+    if (pool->max_queued > 0) {
+        int err = admit(pool, count, internal, block, deadline);
+        if (err != 0) {
+            return err;
+        }
+    }
+    task_t task;
+    task.enqueued = pool->timing ? stats_clock_ns() : 0;
+
+    if (pool->mode == THREAD_POOL_RING_BUFFER) {
+        // A defer from outside is counted until it stops touching the pool,
+        // destroy waits for it, or it sees the closed ring and is rejected.
+        if (!late && (atomic_fetch_add(&pool->ring_submitters, 1) & RING_CLOSED) != 0) {
+            atomic_fetch_sub(&pool->ring_submitters, 1);
+            if (pool->max_queued > 0) {
+                release_space(pool, count);
+            }
+            return -1;
+        }
+        size_t pushed = 0;
+        for (; pushed < count; ++pushed) {
+            source_get(source, pushed, &task);
+            if (!ring_push(pool->ring, &task)) {
+                break;
+            }
+        }
+        *deferred = pushed;
+        int err = wake_threads(pool, pushed);
+        // Dequeue position first, so the difference can't be negative.
+        size_t dequeued = atomic_load(&pool->ring->dequeue_pos);
+        size_t enqueued = atomic_load(&pool->ring->enqueue_pos);
+        count_submitted(pool, counting, pushed, enqueued - dequeued);
+        if (err == 0) {
+            err = grow(pool, enqueued - dequeued);
+        }
+        if (pushed < count && pool->max_queued > 0) {
+            release_space(pool, count - pushed);
+        }
+        if (!late) {
+            atomic_fetch_sub(&pool->ring_submitters, 1);
+        }
+        return pushed == count ? err : EAGAIN;
+    }
+
+    if (pool->mode == THREAD_POOL_WORK_STEALING && internal
+        && priority == THREAD_POOL_PRIORITY_NORMAL) {
+        // Tasks spawned inside the pool go to the deque of the current thread.
+        for (size_t i = 0; i < count; ++i) {
+            source_get(source, i, &task);
+            int err = deque_push(&worker->deque, &task);
+            if (err != 0) {
+                *deferred = i;
+                if (pool->max_queued > 0) {
+                    release_space(pool, count - i);
+                }
+                count_submitted(pool, worker, i, 0);
+                wake_threads(pool, i);
+                return err;
+            }
+        }
+        *deferred = count;
+        long long size = atomic_load_explicit(&worker->deque.bottom, memory_order_relaxed)
+                         - atomic_load_explicit(&worker->deque.top, memory_order_relaxed);
+        count_submitted(pool, worker, count, size > 0 ? (size_t) size : 0);
+        return wake_threads(pool, count);
+    }
+
+    if (pool->mode != THREAD_POOL_WORK_STEALING && internal && count == 1
+        && priority == THREAD_POOL_PRIORITY_NORMAL) {
+        return submit_local(worker, source, deferred);
+    }
+
+    shard_t* shard = choose_shard(pool, counting);
+    int err = sem_wait(&shard->mutex);
+    if (err != 0) {
+        fprintf(stderr, "ERROR: sem_wait failed\n");
+        return err;
+    }
+    // BEGIN CRITICAL SECTION
+
+    bool finished = !late && atomic_load(&pool->finished);
+    size_t backlog = 0;
+    if (!finished) {
+        for (size_t i = 0; i < count; ++i) {
+            source_get(source, i, &task);
+            push(&shard->queues[priority], &task);
+        }
+        atomic_fetch_add_explicit(&shard->queued, count, memory_order_relaxed);
+        *deferred = count;
+        for (int i = 0; i < THREAD_POOL_PRIORITIES; ++i) {
+            backlog += shard->queues[i].size;
+        }
+        if (counting == NULL) {
+            stats_add(&shard->submitted, count);
+            stats_max(&shard->max_queue_depth, backlog);
+        }
+    }
+
+    // END CRITICAL SECTION
+    err = sem_post(&shard->mutex);
     if (err != 0) {
         fprintf(stderr, "ERROR: sem_post failed\n");
         return err;
     }
 
+    if (finished) {
+        if (pool->max_queued > 0) {
+            release_space(pool, count);
+        }
+        return -1;
+    }
+
+    if (counting != NULL) {
+        count_submitted(pool, counting, count, backlog);
+    }
+    err = wake_threads(pool, count);
+    if (err != 0) {
+        return err;
+    }
+    return grow(pool, backlog);
+}
+
+int defer(struct thread_pool* pool, runnable_t runnable) {
+    return defer_batch(pool, &runnable, 1);
+}
+
+int defer_prio(thread_pool_t* pool, runnable_t runnable, thread_pool_priority_t priority) {
+    if (priority >= THREAD_POOL_PRIORITIES) {
+        fprintf(stderr, "ERROR: unknown priority\n");
+        return -1;
+    }
+    task_source_t source = {.runnables = &runnable};
+    size_t deferred;
+    return submit(pool, &source, 1, priority, true, NULL, &deferred);
+}
+
+int try_defer(thread_pool_t* pool, runnable_t runnable) {
+    task_source_t source = {.runnables = &runnable};
+    size_t deferred;
+    return submit(pool, &source, 1, THREAD_POOL_PRIORITY_NORMAL, false, NULL, &deferred);
+}
+
+int defer_until(thread_pool_t* pool, runnable_t runnable, const struct timespec* deadline) {
+    task_source_t source = {.runnables = &runnable};
+    size_t deferred;
+    return submit(pool, &source, 1, THREAD_POOL_PRIORITY_NORMAL, true, deadline, &deferred);
+}
+
+int defer_after(thread_pool_t* pool, runnable_t runnable, uint64_t delay_ns) {
+    if (delay_ns == 0) {
+        return defer(pool, runnable);
+    }
+    bool internal = current_worker != NULL && current_worker->pool == pool;
+    return timer_add(pool->timer, runnable, delay_ns, 0, internal);
+}
+
+int defer_every(thread_pool_t* pool, runnable_t runnable, uint64_t period_ns) {
+    if (period_ns == 0) {
+        fprintf(stderr, "ERROR: period has to be positive\n");
+        return -1;
+    }
+    bool internal = current_worker != NULL && current_worker->pool == pool;
+    return timer_add(pool->timer, runnable, period_ns, period_ns, internal);
+}
+
+int defer_batch(thread_pool_t* pool, const runnable_t* runnables, size_t count) {
+    size_t deferred;
+    return defer_batch_counted(pool, runnables, count, &deferred);
+}
+
+int defer_batch_counted(thread_pool_t* pool, const runnable_t* runnables, size_t count,
+                        size_t* deferred) {
+    task_source_t source = {.runnables = runnables};
+    return submit(pool, &source, count, THREAD_POOL_PRIORITY_NORMAL, true, NULL, deferred);
+}
+
+int defer_inline(thread_pool_t* pool, void (*function)(void*, size_t),
+                 const void* arg, size_t argsz) {
+    return defer_batch_inline(pool, function, arg, argsz, 1);
+}
+
+int defer_batch_inline(thread_pool_t* pool, void (*function)(void*, size_t),
+                       const void* args, size_t argsz, size_t count) {
+    if (argsz > THREAD_POOL_INLINE_ARGS) {
+        fprintf(stderr, "ERROR: inline arguments too big\n");
+        return -1;
+    }
+    task_source_t source = {
+        .runnables = NULL,
+        .function = function,
+        .args = args,
+        .argsz = argsz,
+    };
+    size_t deferred;
+    return submit(pool, &source, count, THREAD_POOL_PRIORITY_NORMAL, true, NULL, &deferred);
+}
+
+size_t thread_pool_allocations(thread_pool_t* pool) {
+    size_t allocations = 0;
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        shard_t* shard = &pool->shards[i];
+        if (sem_wait(&shard->mutex) != 0) {
+            fprintf(stderr, "ERROR: sem_wait failed\n");
+            return 0;
+        }
+        for (int j = 0; j < THREAD_POOL_PRIORITIES; ++j) {
+            allocations += shard->queues[j].nodes.allocations;
+        }
+        sem_post(&shard->mutex);
+    }
+
+    for (size_t i = 0; i < pool->pool_size; ++i) {
+        if (atomic_load_explicit(&pool->workers[i].ready, memory_order_acquire)) {
+            allocations += atomic_load_explicit(&pool->workers[i].deque.allocations,
+                                                memory_order_relaxed);
+        }
+    }
+    return allocations;
+}
+
+void thread_pool_stats(thread_pool_t* pool, thread_pool_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < pool->shards_count; ++i) {
+        shard_t* shard = &pool->shards[i];
+        stats->submitted += atomic_load_explicit(&shard->submitted, memory_order_relaxed);
+        uint64_t depth = atomic_load_explicit(&shard->max_queue_depth, memory_order_relaxed);
+        if (depth > stats->max_queue_depth) {
+            stats->max_queue_depth = depth;
+        }
+    }
+    for (size_t i = 0; i < pool->pool_size; ++i) {
+        stats_collect(stats, &pool->workers[i].stats);
+    }
+}
+
+int thread_pool_worker_stats(thread_pool_t* pool, size_t worker, thread_pool_stats_t* stats) {
+    if (worker >= pool->pool_size) {
+        fprintf(stderr, "ERROR: unknown worker\n");
+        return -1;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats_collect(stats, &pool->workers[worker].stats);
     return 0;
 }
+
+void cancel_token_init(cancel_token_t* token) {
+    atomic_init(&token->cancelled, false);
+}
+
+void cancel(cancel_token_t* token) {
+    atomic_store_explicit(&token->cancelled, true, memory_order_release);
+}
+
+bool cancel_requested(const cancel_token_t* token) {
+    return token != NULL && atomic_load_explicit(&token->cancelled, memory_order_acquire);
+}
+
+int thread_pool_help(void) {
+    worker_t* worker = current_worker;
+    if (worker == NULL) {
+        return -1;
+    }
+    task_t task;
+    int found = find_task(worker, &task);
+    if (found > 0) {
+        run_task(worker, &task, 0);
+    }
+    return found;
+}
+
+int thread_pool_help_wait(atomic_int* word, int value, const struct timespec* deadline) {
+    if (current_worker == NULL) {
+        return -1;
+    }
+    uint64_t backoff = HELP_WAIT_MIN_NS;
+    while (atomic_load_explicit(word, memory_order_acquire) == value) {
+        int helped = thread_pool_help();
+        if (helped < 0) {
+            return helped;
+        }
+        if (helped > 0) {
+            backoff = HELP_WAIT_MIN_NS;
+            continue;
+        }
+        // Nothing to help with, sleep a while and look again:
+        // new tasks may come before the word changes.
+        struct timespec wake;
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_nsec += backoff;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_nsec -= 1000000000;
+            ++wake.tv_sec;
+        }
+        bool last = deadline != NULL
+                    && (deadline->tv_sec < wake.tv_sec
+                        || (deadline->tv_sec == wake.tv_sec && deadline->tv_nsec <= wake.tv_nsec));
+        if (futex_wait(word, value, last ? deadline : &wake) == ETIMEDOUT && last) {
+            return ETIMEDOUT;
+        }
+        backoff = backoff * 2 < HELP_WAIT_MAX_NS ? backoff * 2 : HELP_WAIT_MAX_NS;
+    }
+    return 0;
+}
+
+size_t thread_pool_threads(thread_pool_t* pool) {
+    return atomic_load(&pool->threads_count);
+}
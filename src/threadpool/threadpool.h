@@ -11,8 +11,27 @@
 
 #include <semaphore.h>
 #include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "slab.h"
+
+/**
+ * Size of the cache line used to separate fields written by different threads.
+ */
+#define CACHE_LINE 64
+
+/**
+ * Cancellation token shared by any number of tasks.
+ * Cancellation is cooperative: queued tasks carrying a cancelled token are
+ * skipped, running ones have to poll it with cancel_requested.
+ */
+typedef struct cancel_token {
+  atomic_bool cancelled; ///< information if cancellation was requested;
+} cancel_token_t;
 
 /**
  * Runnable function
@@ -21,13 +40,34 @@ typedef struct runnable {
   void (*function)(void *, size_t); ///< f(arg, argsz);
   void *arg; ///<                   array of arguments;
   size_t argsz; ///<               number of arguments;
+  cancel_token_t *token; ///< token skipping the queued task, may be NULL;
 } runnable_t;
 
+/**
+ * Maximal number of argument bytes stored inline in a task.
+ */
+#define THREAD_POOL_INLINE_ARGS 64
+
+/**
+ * Task stored in the queues
+ */
+typedef struct task {
+    runnable_t runnable; ///<                             runnable function;
+    size_t inline_size; ///< number of argument bytes in storage, 0 if none;
+    uint64_t enqueued; ///< time of deferring for the statistics, 0 if not timed;
+    alignas(max_align_t) unsigned char storage[THREAD_POOL_INLINE_ARGS]; ///< inline arguments;
+} task_t;
+
+/**
+ * Number of bytes of the task that have to be copied.
+ */
+#define TASK_SIZE(task) (offsetof(task_t, storage) + (task)->inline_size)
+
 /**
  * Single queue node
  */
 typedef struct node {
-    runnable_t runnable; ///<      runnable function;
+    task_t task; ///<                   stored task;
     struct node* next; ///< pointer to the next node;
 } node_t;
 
@@ -38,21 +78,148 @@ typedef struct queue {
     node_t* first; ///< pointer to the first element;
     node_t* last;  ///<  pointer to the last element;
     size_t size;   ///<            size of the queue;
+    slab_t nodes;  ///<      allocator of the nodes;
 } queue_t;
 
+/**
+ * Priority of a task
+ */
+typedef enum thread_pool_priority {
+    THREAD_POOL_PRIORITY_HIGH, ///<      latency-critical tasks;
+    THREAD_POOL_PRIORITY_NORMAL, ///< tasks deferred by defer;
+    THREAD_POOL_PRIORITY_LOW, ///<       background tasks;
+    THREAD_POOL_PRIORITIES, ///<       number of priorities;
+} thread_pool_priority_t;
+
+/**
+ * Scheduling mode of the thread-pool
+ */
+typedef enum thread_pool_mode {
+    THREAD_POOL_SHARED_QUEUE, ///< one FIFO queue and a LIFO slot per thread;
+    THREAD_POOL_WORK_STEALING, ///< per-thread deques, idle threads steal;
+    THREAD_POOL_RING_BUFFER, ///<     bounded lock-free MPMC ring buffer;
+    THREAD_POOL_SHARDED_QUEUES, ///< queues split into shards with own locks;
+} thread_pool_mode_t;
+
+/**
+ * Placement of the threads on the CPUs
+ */
+typedef enum thread_pool_placement {
+    THREAD_POOL_PLACEMENT_NONE, ///<       threads are not pinned;
+    THREAD_POOL_PLACEMENT_COMPACT, ///< fill one NUMA node after another;
+    THREAD_POOL_PLACEMENT_SPREAD, ///<  round-robin over the NUMA nodes;
+} thread_pool_placement_t;
+
+/**
+ * Options of the thread-pool
+ */
+typedef struct thread_pool_options {
+    size_t pool_size; ///<           number of threads;
+    thread_pool_mode_t mode; ///< scheduling mode;
+    size_t capacity; ///<  capacity of the ring buffer;
+    size_t shards; ///< number of queue shards (sharded mode), 0 for one per thread;
+    size_t max_queued; ///< maximal number of tasks waiting to start, 0 for unbounded;
+    thread_pool_placement_t placement; ///< placement of the threads;
+    const int* cpus; ///< CPUs to pin the threads to, each one allowed, NULL for all allowed ones;
+    size_t cpus_count; ///<                  number of the CPUs;
+    size_t max_pool_size; ///< maximal number of threads, 0 for a fixed-size pool;
+    size_t grow_backlog; ///< number of queued tasks that makes the pool grow;
+    uint64_t keepalive_ns; ///< idle time after which an extra thread exits;
+    size_t spin_count; ///< pause iterations an idle thread spins before parking, 0 to park at once;
+    size_t yield_count; ///<  sched_yield calls after spinning, before parking;
+    bool timing; ///< information if the wait and run times are measured;
+} thread_pool_options_t;
+
+/**
+ * Number of buckets of the duration histograms.
+ * Bucket 0 counts durations below 2 ns, bucket i counts durations
+ * in [2^i, 2^(i+1)) ns, the last one (about 9 minutes) everything longer.
+ */
+#define THREAD_POOL_HISTOGRAM_BUCKETS 40
+
+/**
+ * Statistics of the pool or of a single worker
+ */
+typedef struct thread_pool_stats {
+    uint64_t submitted; ///<                      number of deferred tasks;
+    uint64_t executed; ///<                           number of run tasks;
+    uint64_t cancelled; ///<   number of tasks skipped as cancelled;
+    uint64_t steals; ///<   number of tasks stolen (work-stealing mode);
+    uint64_t max_queue_depth; ///< largest number of queued tasks seen when deferring;
+    uint64_t busy_ns; ///<                      time spent running tasks;
+    uint64_t wait_histogram[THREAD_POOL_HISTOGRAM_BUCKETS]; ///< times from deferring to start;
+    uint64_t run_histogram[THREAD_POOL_HISTOGRAM_BUCKETS]; ///<            run durations;
+} thread_pool_stats_t;
+
+/**
+ * State of a single thread (defined in threadpool.c)
+ */
+struct worker;
+
+/**
+ * Bounded MPMC queue (defined in ring.h)
+ */
+struct ring;
+
+/**
+ * Timer wheel of the delayed tasks (defined in timer.h)
+ */
+struct timer_wheel;
+
+/**
+ * Queues of tasks under their own lock, one per priority.
+ * Aligned to a cache line, so shards used by different threads share no line.
+ */
+typedef struct shard {
+    alignas(CACHE_LINE) sem_t mutex; ///<              lock of the shard;
+    atomic_size_t queued; ///<         number of tasks in the queues;
+    queue_t queues[THREAD_POOL_PRIORITIES]; ///< queues of tasks, one per priority;
+    unsigned credits[THREAD_POOL_PRIORITIES]; ///< pops left for every priority in this round;
+    atomic_uint_least64_t submitted; ///< tasks deferred from outside of the pool;
+    atomic_uint_least64_t max_queue_depth; ///< largest backlog seen from outside of the pool;
+} shard_t;
+
 /**
  * Thread-pool
  */
 typedef struct thread_pool {
-    size_t pool_size; ///<                  number of threads;
+    size_t pool_size; ///<          maximal number of threads;
+    size_t min_threads; ///< number of threads that never exit;
+    atomic_size_t threads_count; ///< current number of threads;
+    size_t grow_backlog; ///< number of queued tasks that makes the pool grow;
+    uint64_t keepalive_ns; ///< idle time after which an extra thread exits;
+    thread_pool_mode_t mode; ///<             scheduling mode;
     sem_t mutex; ///<                       thread-pool mutex;
-    sem_t waiting_threads; ///<    semaphore for free threads;
-    queue_t* queue; ///<        pointer to the queue of tasks;
+    sem_t waiting_threads; ///<  semaphore for sleeping threads;
+    atomic_size_t sleeping; ///< number of threads to be woken;
+    atomic_size_t spinning; ///< number of idle threads looking for tasks;
+    size_t spin_count; ///<  maximal number of spin iterations;
+    size_t yield_count; ///<  number of sched_yield calls;
+    bool timing; ///<  information if the tasks are timed;
+    shard_t* shards; ///< shards of the queues, one unless sharded;
+    size_t shards_count; ///<            number of the shards;
+    size_t max_queued; ///< maximal number of waiting tasks, 0 for unbounded;
+    atomic_size_t pending; ///< tasks deferred and not started (bounded pools);
+    atomic_size_t space_waiters; ///< producers waiting for space in the pool;
+    atomic_int space; ///<       futex word bumped when tasks start;
+    struct ring* ring; ///<  ring of tasks (ring buffer mode);
+    atomic_size_t ring_submitters; ///< defers from outside into the ring, high bit closes it;
+    struct worker* workers; ///<        state of every thread;
+    struct timer_wheel* timer; ///<   wheel of the delayed tasks;
     pthread_t* threads; ///<                 array of threads;
-    bool finished; ///< information about finishing all tasks;
+    atomic_bool finished; ///< information about finishing all tasks;
+    atomic_int starting; ///<   number of threads still starting;
     pthread_attr_t attr; ///<      standard pthread attribute;
 } thread_pool_t;
 
+/** @brief Fill the options with default values.
+ * Default options describe a pool with one shared FIFO queue,
+ * the same as the one created by thread_pool_init.
+ * @param[out] options  –   pointer to the options;
+ * @param[in] pool_size – size of the thread-pool;
+ */
+void thread_pool_options_init(thread_pool_options_t* options, size_t pool_size);
+
 /** @brief Initialize the thread-pool.
  * Create a thread_pool_t object at argument pool
  * with number of thread passed as pool_size argument.
@@ -63,19 +230,254 @@ typedef struct thread_pool {
  */
 int thread_pool_init(thread_pool_t *pool, size_t pool_size);
 
+/** @brief Initialize the thread-pool with given options.
+ * In the THREAD_POOL_WORK_STEALING mode every thread owns a deque.
+ * Tasks deferred from inside the pool are pushed to the deque of the
+ * current thread, other tasks go to the shared (injection) queue.
+ * Idle threads steal the oldest tasks from random victims.
+ * In the THREAD_POOL_SHARED_QUEUE mode a single task deferred from inside
+ * the pool goes to the LIFO slot of the current thread and runs next.
+ * In the THREAD_POOL_SHARDED_QUEUES mode the queues are split into
+ * options->shards shards with own locks (one per thread by default).
+ * A thread of the pool defers to and pops from its home shard first,
+ * other threads defer to the less loaded of two random shards.
+ * In the THREAD_POOL_RING_BUFFER mode tasks are kept in a lock-free ring
+ * of options->capacity cells (rounded up to a power of two).
+ * With options->max_queued the pool is bounded: at most that many tasks wait
+ * to start, defer blocks until there is space and try_defer fails instead.
+ * If options->max_pool_size is bigger than options->pool_size, the pool is elastic:
+ * it starts options->pool_size threads, spawns a new one (up to options->max_pool_size)
+ * when at least options->grow_backlog tasks are queued and no thread is idle, and
+ * retires threads above options->pool_size after options->keepalive_ns of idleness.
+ * @param[in,out] pool  – pointer to the thread-pool;
+ * @param[in] options   –    options of the pool;
+ * @return @p 0, if init was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int thread_pool_init_with(thread_pool_t *pool, const thread_pool_options_t *options);
+
 /** @brief Destroy the thread-pool.
  * Finish all of the tasks and remove the pool.
+ * Tasks deferred by the running tasks are finished too,
+ * defer called from outside of the pool fails from now on.
  * @param[in,out] pool –    pointer to the thread-pool;
  */
 void thread_pool_destroy(thread_pool_t *pool);
 
 /**
  * @brief Add a new task to the pool.
+ * In a bounded pool (options.max_queued) a thread outside of the pool
+ * waits until there is space for the task.
  * @param[in, out] pool – pointer to thread-pool;
  * @param[in] runnable  – task that will be run on the pool.
  * @return @p 0, if defer was finished correctly.
- * Non-zero value, if errors occurred.
+ * Non-zero value, if errors occurred or the ring buffer is full.
  */
 int defer(thread_pool_t *pool, runnable_t runnable);
 
+/**
+ * @brief Add a new task with the given priority to the pool.
+ * Every priority has its own queue. Threads serve them in weighted
+ * round-robin (4:2:1 from high to low), so with all queues busy
+ * a low-priority task still gets one of every seven pops.
+ * In the work-stealing mode tasks of normal priority deferred from inside
+ * the pool go to the deque of the current thread, in the shared queue mode
+ * to its LIFO slot, the others to the shared queues. The ring buffer mode
+ * has one FIFO and ignores priorities.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnable  – task that will be run on the pool;
+ * @param[in] priority  –       priority of the task;
+ * @return @p 0, if defer was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int defer_prio(thread_pool_t *pool, runnable_t runnable, thread_pool_priority_t priority);
+
+/**
+ * @brief Add a new task to the pool if there is space for it.
+ * Never blocks: when the pool is bounded (options.max_queued) and full,
+ * or the ring buffer is full, the task is rejected.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnable  – task that will be run on the pool;
+ * @return @p 0, if defer was finished correctly, @p EAGAIN if the pool is full.
+ * Other non-zero value, if errors occurred.
+ */
+int try_defer(thread_pool_t *pool, runnable_t runnable);
+
+/**
+ * @brief Add a new task to the pool, waiting for space until the deadline.
+ * Same as defer in a pool that is not bounded (options.max_queued).
+ * Threads of the pool never wait for space and are not limited by the bound,
+ * but in the ring buffer mode they still get @p EAGAIN when the ring is full.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnable  – task that will be run on the pool;
+ * @param[in] deadline  –  absolute CLOCK_MONOTONIC time;
+ * @return @p 0, if defer was finished correctly,
+ * @p ETIMEDOUT if there was no space before the deadline.
+ * Other non-zero value, if errors occurred.
+ */
+int defer_until(thread_pool_t *pool, runnable_t runnable, const struct timespec *deadline);
+
+/**
+ * @brief Add a new task to the pool after a delay.
+ * The task is kept in the timer wheel of the pool until it is due,
+ * so it does not occupy any thread while waiting.
+ * The wheel has a resolution of 1 ms, the task is never deferred earlier than after the delay.
+ * thread_pool_destroy waits for delayed tasks, also for those added
+ * by its running tasks; other threads can't add them during destroy.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnable  – task that will be run on the pool;
+ * @param[in] delay_ns  –        delay in nanoseconds;
+ * @return @p 0, if defer was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int defer_after(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns);
+
+/**
+ * @brief Add a task to the pool periodically.
+ * The task is deferred for the first time after one period and then every period,
+ * until the pool is destroyed or the token of the runnable is cancelled.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnable  – task that will be run on the pool;
+ * @param[in] period_ns –      period in nanoseconds;
+ * @return @p 0, if defer was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int defer_every(thread_pool_t *pool, runnable_t runnable, uint64_t period_ns);
+
+/**
+ * @brief Add many tasks to the pool at once.
+ * The whole batch is linked into the queue under a single lock acquisition
+ * and at most @p count sleeping threads are woken, one post per thread.
+ * In the ring buffer mode the tasks preceding the first one that did not fit
+ * stay deferred.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] runnables –        array of tasks;
+ * @param[in] count     –       number of tasks;
+ * @return @p 0, if every task was deferred correctly.
+ * Non-zero value, if errors occurred or the ring buffer is full.
+ */
+int defer_batch(thread_pool_t *pool, const runnable_t *runnables, size_t count);
+
+/**
+ * @brief Add many tasks to the pool at once and tell how many were added.
+ * Same as defer_batch, but when it fails partway the caller learns which
+ * tasks stay deferred: always the first @p deferred ones.
+ * @param[in, out] pool   – pointer to thread-pool;
+ * @param[in] runnables   –        array of tasks;
+ * @param[in] count       –       number of tasks;
+ * @param[out] deferred   – number of the first tasks that were deferred;
+ * @return @p 0, if every task was deferred correctly.
+ * Non-zero value, if errors occurred or the ring buffer is full.
+ */
+int defer_batch_counted(thread_pool_t *pool, const runnable_t *runnables, size_t count,
+                        size_t *deferred);
+
+/**
+ * @brief Add a new task with inline arguments to the pool.
+ * The argsz bytes at arg are copied into the queue, the function gets
+ * a pointer to the copy, valid until it returns. No allocation is needed.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] function  – function that will be run on the pool;
+ * @param[in] arg       –        arguments to be copied;
+ * @param[in] argsz     – size of the arguments, at most THREAD_POOL_INLINE_ARGS;
+ * @return @p 0, if defer was finished correctly.
+ * Non-zero value, if errors occurred or the arguments are too big.
+ */
+int defer_inline(thread_pool_t *pool, void (*function)(void *, size_t),
+                 const void *arg, size_t argsz);
+
+/**
+ * @brief Add many tasks with inline arguments to the pool at once.
+ * Task i gets the copy of argsz bytes at args + i * argsz.
+ * Deferred like defer_batch, copied like defer_inline.
+ * @param[in, out] pool – pointer to thread-pool;
+ * @param[in] function  – function that will be run on the pool;
+ * @param[in] args      –   array of arguments of the tasks;
+ * @param[in] argsz     – size of the arguments of one task, at most THREAD_POOL_INLINE_ARGS;
+ * @param[in] count     –               number of tasks;
+ * @return @p 0, if every task was deferred correctly.
+ * Non-zero value, if errors occurred or the arguments are too big.
+ */
+int defer_batch_inline(thread_pool_t *pool, void (*function)(void *, size_t),
+                       const void *args, size_t argsz, size_t count);
+
+/** @brief Prepare a token that is not cancelled.
+ * @param[out] token – pointer to the token;
+ */
+void cancel_token_init(cancel_token_t *token);
+
+/** @brief Request cancellation of every task carrying the token.
+ * Tasks still queued are dropped when a thread takes them, without calling
+ * their function; running tasks see the request through cancel_requested.
+ * The token has to outlive the tasks carrying it.
+ * @param[in,out] token – pointer to the token;
+ */
+void cancel(cancel_token_t *token);
+
+/** @brief Check if cancellation was requested.
+ * Cheap enough to be polled in the inner loop of a long task.
+ * @param[in] token – pointer to the token, @p NULL is never cancelled;
+ * @return @p true, if the token was cancelled.
+ */
+bool cancel_requested(const cancel_token_t *token);
+
+/** @brief Run a queued task on the current thread instead of blocking.
+ * Meant for primitives that wait inside tasks (await, parallel loops):
+ * a worker that would block runs other tasks of its own pool in the meantime,
+ * so waiting tasks don't take threads away and a small pool can't deadlock
+ * on recursive divide-and-conquer. In the work-stealing mode the newest task
+ * of the own deque is taken first, usually the one the waiter is waiting for.
+ * @return @p 1, if a task was run, @p 0 if there were no tasks,
+ * @p -1 if the calling thread is not a worker of any pool.
+ */
+int thread_pool_help(void);
+
+/** @brief Wait while the word holds the value, helping the pool meanwhile.
+ * A worker runs queued tasks of its pool (see thread_pool_help) and, when
+ * there are none, sleeps on the word for a short, growing time before looking
+ * into the queues again. The word has to be woken with futex_wake when it changes.
+ * @param[in] word     – watched futex word;
+ * @param[in] value    –  value to wait on;
+ * @param[in] deadline – absolute CLOCK_MONOTONIC time, @p NULL to wait without limit;
+ * @return @p 0, if the word changed, @p ETIMEDOUT if the deadline passed,
+ * @p -1 if the calling thread is not a worker, so it has to block on its own.
+ */
+int thread_pool_help_wait(atomic_int *word, int value, const struct timespec *deadline);
+
+/** @brief Count the threads of the pool.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @return Number of running threads.
+ */
+size_t thread_pool_threads(thread_pool_t *pool);
+
+/** @brief Count the heap allocations made by the pool.
+ * Queue nodes and deque arrays are recycled, so the counter grows only
+ * until the pool reaches its peak queue length. Used to check that the
+ * steady-state defer/run path does not allocate.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @return Number of chunks and arrays taken from the heap since init.
+ */
+size_t thread_pool_allocations(thread_pool_t *pool);
+
+/** @brief Read the statistics of the whole pool.
+ * Every worker keeps its own counters, written without locked instructions,
+ * and they are summed on read, so the counters are always on. The result
+ * is not an atomic snapshot: counters updated while reading may be off
+ * by the tasks that are running at the moment.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[out] stats   –   sum of the statistics of every worker,
+ *                         plus the tasks deferred from outside of the pool;
+ */
+void thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+
+/** @brief Read the statistics of a single worker.
+ * Counters of a slot reused by an elastic pool include its previous threads.
+ * @param[in,out] pool – pointer to the thread-pool;
+ * @param[in] worker   – index of the worker, below max_pool_size;
+ * @param[out] stats   –  statistics of the worker;
+ * @return @p 0, if the statistics were read correctly.
+ * Non-zero value, if there is no such worker.
+ */
+int thread_pool_worker_stats(thread_pool_t *pool, size_t worker, thread_pool_stats_t *stats);
+
 #endif // __THREADPOOL_H__
@@ -0,0 +1,357 @@
+/** @file
+ * Hierarchical timer wheel implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#include "timer.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "futex.h"
+
+/**
+ * Number of entries allocated at once by the slab.
+ */
+#define ENTRIES_PER_CHUNK 64
+
+/**
+ * Number of ticks covered by the whole wheel.
+ */
+#define WHEEL_TICKS (1ULL << (TIMER_LEVELS * TIMER_LEVEL_BITS))
+
+/**
+ * Wheel of the timer thread, @p NULL in other threads.
+ */
+static _Thread_local const timer_wheel_t* current_timer = NULL;
+
+/** @brief Lock the mutex of the wheel.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+static void lock(timer_wheel_t* timer) {
+    if (sem_wait(&timer->mutex) != 0) {
+        fprintf(stderr, "ERROR: sem_wait failed\n");
+        exit(-1);
+    }
+}
+
+/** @brief Unlock the mutex of the wheel.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+static void unlock(timer_wheel_t* timer) {
+    if (sem_post(&timer->mutex) != 0) {
+        fprintf(stderr, "ERROR: sem_post failed\n");
+        exit(-1);
+    }
+}
+
+/** @brief Wake the timer thread.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+static void wake(timer_wheel_t* timer) {
+    atomic_fetch_add(&timer->signal, 1);
+    futex_wake(&timer->signal, 1);
+}
+
+/** @brief Time elapsed since the tick 0.
+ * @param[in] timer – pointer to the wheel;
+ * @return Number of nanoseconds.
+ */
+static uint64_t elapsed_ns(const timer_wheel_t* timer) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) (now.tv_sec - timer->start.tv_sec) * 1000000000ULL
+           + now.tv_nsec - timer->start.tv_nsec;
+}
+
+/** @brief Absolute time of the beginning of the tick.
+ * @param[in] timer – pointer to the wheel;
+ * @param[in] tick  –     number of the tick;
+ * @return CLOCK_MONOTONIC time.
+ */
+static struct timespec tick_time(const timer_wheel_t* timer, uint64_t tick) {
+    uint64_t nsec = timer->start.tv_nsec + tick * TIMER_TICK_NS;
+    struct timespec time = {
+        .tv_sec = timer->start.tv_sec + (time_t) (nsec / 1000000000ULL),
+        .tv_nsec = (long) (nsec % 1000000000ULL),
+    };
+    return time;
+}
+
+/** @brief Put the entry in the slot matching its tick.
+ * The entry can't be due before the current tick.
+ * Entries due after the end of the wheel are put in the last slot
+ * and inserted again when they are cascaded.
+ * @param[in,out] timer – pointer to the wheel;
+ * @param[in] entry     – entry to be inserted;
+ */
+static void insert(timer_wheel_t* timer, timer_entry_t* entry) {
+    uint64_t expires = entry->expires;
+    if (expires - timer->current >= WHEEL_TICKS) {
+        expires = timer->current + WHEEL_TICKS - 1;
+    }
+    uint64_t delta = expires - timer->current;
+    int level = 0;
+    while (delta >= 1ULL << ((level + 1) * TIMER_LEVEL_BITS)) {
+        ++level;
+    }
+    size_t slot = (expires >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1);
+    entry->next = timer->slots[level][slot];
+    timer->slots[level][slot] = entry;
+}
+
+/** @brief Forget a one-shot entry that has left the wheel.
+ * When the last one of a finishing wheel is gone, the pool is told,
+ * so its threads waiting for delayed tasks can exit.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+static void one_shot_done(timer_wheel_t* timer) {
+    if (atomic_fetch_sub(&timer->one_shot, 1) == 1 && timer->finishing) {
+        timer->drained(timer->pool);
+    }
+}
+
+/** @brief Hand the due entry to the pool.
+ * Periodic entries are inserted again, the others are freed.
+ * Entries with a cancelled token are freed without deferring,
+ * which is how a periodic task is stopped.
+ * If the pool rejects the task (it is full), it is retried in the next tick,
+ * so the timer thread never waits for space.
+ * @param[in,out] timer – pointer to the wheel;
+ * @param[in] entry     –      due entry;
+ */
+static void expire(timer_wheel_t* timer, timer_entry_t* entry) {
+    if (cancel_requested(entry->runnable.token)) {
+        --timer->pending;
+        bool one_shot = entry->period == 0;
+        slab_free(&timer->entries, entry);
+        if (one_shot) {
+            one_shot_done(timer);
+        }
+        return;
+    }
+    if (entry->period > 0 && timer->finishing) {
+        --timer->pending;
+        slab_free(&timer->entries, entry);
+        return;
+    }
+    if (try_defer(timer->pool, entry->runnable) != 0) {
+        entry->expires = timer->current + 1;
+        insert(timer, entry);
+        return;
+    }
+    if (entry->period > 0) {
+        entry->expires = timer->current + entry->period;
+        insert(timer, entry);
+        return;
+    }
+    // The task is in the pool before the entry stops being counted.
+    --timer->pending;
+    slab_free(&timer->entries, entry);
+    one_shot_done(timer);
+}
+
+/** @brief Process the next tick.
+ * Cascade the higher levels that wrap around in this tick
+ * and expire the entries from the slot of the tick.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+static void advance(timer_wheel_t* timer) {
+    uint64_t tick = ++timer->current;
+    for (int level = 1; level < TIMER_LEVELS; ++level) {
+        if ((tick & ((1ULL << (level * TIMER_LEVEL_BITS)) - 1)) != 0) {
+            break;
+        }
+        size_t slot = (tick >> (level * TIMER_LEVEL_BITS)) & (TIMER_SLOTS - 1);
+        timer_entry_t* entry = timer->slots[level][slot];
+        timer->slots[level][slot] = NULL;
+        while (entry != NULL) {
+            timer_entry_t* next = entry->next;
+            insert(timer, entry);
+            entry = next;
+        }
+    }
+
+    timer_entry_t* entry = timer->slots[0][tick & (TIMER_SLOTS - 1)];
+    timer->slots[0][tick & (TIMER_SLOTS - 1)] = NULL;
+    while (entry != NULL) {
+        timer_entry_t* next = entry->next;
+        if (entry->expires > tick) {
+            // Entry was clamped to the end of the wheel.
+            insert(timer, entry);
+        } else {
+            expire(timer, entry);
+        }
+        entry = next;
+    }
+}
+
+/** @brief Find the tick the timer thread has to wake up in.
+ * It is the first non-empty slot of the lowest level
+ * or the next cascade, whichever comes first.
+ * @param[in] timer – pointer to the wheel;
+ * @return Number of the tick.
+ */
+static uint64_t next_tick(const timer_wheel_t* timer) {
+    uint64_t tick = timer->current + 1;
+    while (timer->slots[0][tick & (TIMER_SLOTS - 1)] == NULL && (tick & (TIMER_SLOTS - 1)) != 0) {
+        ++tick;
+    }
+    return tick;
+}
+
+/** @brief Function run by the timer thread.
+ * Process the ticks that have passed and sleep until the next one
+ * that has something to do. Finish when the wheel is destroyed,
+ * after the threads of the pool, so no one-shot entry is left.
+ * @param[in,out] arg – pointer to the wheel;
+ * @return @p NULL.
+ */
+static void* timer_function(void* arg) {
+    timer_wheel_t* timer = arg;
+    current_timer = timer;
+    lock(timer);
+    while (true) {
+        uint64_t now = elapsed_ns(timer) / TIMER_TICK_NS;
+        while (timer->current < now) {
+            advance(timer);
+        }
+        if (timer->stopped) {
+            break;
+        }
+
+        struct timespec deadline;
+        const struct timespec* limit = NULL;
+        if (timer->pending > 0) {
+            timer->wakeup = next_tick(timer);
+            deadline = tick_time(timer, timer->wakeup);
+            limit = &deadline;
+        } else {
+            timer->wakeup = UINT64_MAX;
+        }
+        int signal = atomic_load(&timer->signal);
+        unlock(timer);
+
+        futex_wait(&timer->signal, signal, limit);
+
+        lock(timer);
+    }
+    unlock(timer);
+    return NULL;
+}
+
+int timer_init(timer_wheel_t* timer, thread_pool_t* pool, void (*drained)(thread_pool_t*)) {
+    if (sem_init(&timer->mutex, 0, 1) != 0) {
+        fprintf(stderr, "ERROR: timer sem_init failed\n");
+        return -1;
+    }
+    timer->pool = pool;
+    timer->drained = drained;
+    atomic_init(&timer->signal, 0);
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+    timer->current = 0;
+    timer->wakeup = UINT64_MAX;
+    timer->pending = 0;
+    atomic_init(&timer->one_shot, 0);
+    for (int level = 0; level < TIMER_LEVELS; ++level) {
+        for (int slot = 0; slot < TIMER_SLOTS; ++slot) {
+            timer->slots[level][slot] = NULL;
+        }
+    }
+    slab_init(&timer->entries, sizeof(timer_entry_t), ENTRIES_PER_CHUNK);
+    timer->started = false;
+    timer->finishing = false;
+    timer->stopped = false;
+    return 0;
+}
+
+void timer_finish(timer_wheel_t* timer) {
+    lock(timer);
+    timer->finishing = true;
+    unlock(timer);
+}
+
+void timer_destroy(timer_wheel_t* timer) {
+    lock(timer);
+    timer->stopped = true;
+    bool started = timer->started;
+    wake(timer);
+    unlock(timer);
+
+    if (started) {
+        pthread_join(timer->thread, NULL);
+    }
+    slab_destroy(&timer->entries);
+    sem_destroy(&timer->mutex);
+}
+
+bool timer_is_current(const timer_wheel_t* timer) {
+    return current_timer == timer;
+}
+
+int timer_add(timer_wheel_t* timer, runnable_t runnable, uint64_t delay_ns, uint64_t period_ns,
+              bool internal) {
+    lock(timer);
+    // BEGIN CRITICAL SECTION
+
+    // Threads of the pool are still running, so their one-shot tasks will be run.
+    if (timer->stopped || (timer->finishing && (period_ns > 0 || !internal))) {
+        unlock(timer);
+        fprintf(stderr, "ERROR: timer is stopped\n");
+        return -1;
+    }
+    if (!timer->started) {
+        // The thread inherits the mask: SIGINT is handled by a thread that
+        // can destroy the pool, never by the timer thread joined in destroy.
+        sigset_t block_mask;
+        sigset_t old_mask;
+        sigemptyset(&block_mask);
+        sigaddset(&block_mask, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &block_mask, &old_mask);
+        int err = pthread_create(&timer->thread, NULL, timer_function, timer);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        if (err != 0) {
+            unlock(timer);
+            fprintf(stderr, "ERROR: timer pthread_create failed\n");
+            return -1;
+        }
+        timer->started = true;
+    }
+
+    timer_entry_t* entry = slab_alloc(&timer->entries);
+    if (entry == NULL) {
+        unlock(timer);
+        return -1;
+    }
+    uint64_t now = elapsed_ns(timer);
+    if (timer->pending == 0 && timer->current < now / TIMER_TICK_NS) {
+        // Nothing to process in the skipped ticks.
+        timer->current = now / TIMER_TICK_NS;
+    }
+    entry->runnable = runnable;
+    // The first tick that starts after the delay has passed,
+    // a delay past the end of the clock never expires earlier.
+    uint64_t due = delay_ns > UINT64_MAX - now ? UINT64_MAX : now + delay_ns;
+    entry->expires = due / TIMER_TICK_NS + (due % TIMER_TICK_NS != 0);
+    if (entry->expires <= timer->current) {
+        entry->expires = timer->current + 1;
+    }
+    entry->period = period_ns / TIMER_TICK_NS + (period_ns % TIMER_TICK_NS != 0);
+    insert(timer, entry);
+    ++timer->pending;
+    if (entry->period == 0) {
+        atomic_fetch_add(&timer->one_shot, 1);
+    }
+    if (entry->expires < timer->wakeup) {
+        timer->wakeup = entry->expires;
+        wake(timer);
+    }
+
+    // END CRITICAL SECTION
+    unlock(timer);
+    return 0;
+}
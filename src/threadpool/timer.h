@@ -0,0 +1,119 @@
+/** @file
+ * Hierarchical timer wheel header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "threadpool.h"
+
+/**
+ * Length of a single tick of the wheel in nanoseconds.
+ */
+#define TIMER_TICK_NS 1000000ULL
+
+/**
+ * Number of bits of the tick used by every level of the wheel.
+ */
+#define TIMER_LEVEL_BITS 6
+
+/**
+ * Number of slots in every level of the wheel.
+ */
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+
+/**
+ * Number of levels of the wheel, together they cover 2^24 ticks (about 4.6 hours).
+ */
+#define TIMER_LEVELS 4
+
+/**
+ * Single delayed task
+ */
+typedef struct timer_entry {
+    runnable_t runnable; ///<                   delayed task;
+    uint64_t expires; ///<      tick in which the task is due;
+    uint64_t period; ///< period in ticks, 0 for one-shot tasks;
+    struct timer_entry* next; ///<    next entry in the slot;
+} timer_entry_t;
+
+/**
+ * Hashed hierarchical timer wheel (G. Varghese, T. Lauck).
+ * Level l keeps entries due in less than TIMER_SLOTS^(l+1) ticks,
+ * hashed by the bits of their tick that belong to this level.
+ * Entries are cascaded to lower levels when the lower level wraps around.
+ */
+typedef struct timer_wheel {
+    thread_pool_t* pool; ///<                         owner of the wheel;
+    sem_t mutex; ///<                                    mutex of the wheel;
+    atomic_int signal; ///<           futex word the timer thread sleeps on;
+    struct timespec start; ///<                           time of the tick 0;
+    uint64_t current; ///<                            last processed tick;
+    uint64_t wakeup; ///<              tick the timer thread sleeps until;
+    size_t pending; ///<                          number of stored entries;
+    atomic_size_t one_shot; ///< number of stored one-shot entries, read by the pool;
+    timer_entry_t* slots[TIMER_LEVELS][TIMER_SLOTS]; ///< lists of entries;
+    slab_t entries; ///<                           allocator of the entries;
+    pthread_t thread; ///<                                    timer thread;
+    bool started; ///<             information if the thread was started;
+    bool finishing; ///<         information about destroying the pool;
+    bool stopped; ///<        information if the thread has to exit;
+    void (*drained)(thread_pool_t*); ///< called when a finishing wheel has no one-shot entries;
+} timer_wheel_t;
+
+/** @brief Initialize an empty wheel.
+ * The timer thread is started by the first call to timer_add.
+ * @param[out] timer  – pointer to the wheel;
+ * @param[in] pool    –  owner of the wheel;
+ * @param[in] drained – called by the timer thread when the last one-shot entry
+ *                      of a finishing wheel is handed to the pool;
+ * @return @p 0, if init was finished correctly.
+ * Non-zero value, if errors occurred.
+ */
+int timer_init(timer_wheel_t* timer, thread_pool_t* pool, void (*drained)(thread_pool_t*));
+
+/** @brief Start finishing the wheel, when the pool is being destroyed.
+ * Periodic tasks are dropped and only threads of the pool can add
+ * one-shot tasks, which are still handed to the pool when they are due.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+void timer_finish(timer_wheel_t* timer);
+
+/** @brief Stop the wheel.
+ * Called after the threads of the pool have exited, so no one-shot task is left.
+ * @param[in,out] timer – pointer to the wheel;
+ */
+void timer_destroy(timer_wheel_t* timer);
+
+/** @brief Check if the calling thread is the timer thread of the wheel.
+ * Its tasks are accepted by the pool after it is finished.
+ * @param[in] timer – pointer to the wheel;
+ * @return @p true, if called by the timer thread.
+ */
+bool timer_is_current(const timer_wheel_t* timer);
+
+/** @brief Schedule the task.
+ * @param[in,out] timer – pointer to the wheel;
+ * @param[in] runnable  –        delayed task;
+ * @param[in] delay_ns  – time after which the task is deferred;
+ * @param[in] period_ns – period of the task, @p 0 for one-shot tasks;
+ * @param[in] internal  – information if called by a thread of the pool;
+ * @return @p 0, if the task was scheduled.
+ * Non-zero value, if the wheel is finishing and does not take the task,
+ * or errors occurred.
+ */
+int timer_add(timer_wheel_t* timer, runnable_t runnable, uint64_t delay_ns, uint64_t period_ns,
+              bool internal);
+
+#endif // __TIMER_H__
@@ -0,0 +1,149 @@
+/** @file
+ * CPU and NUMA topology implementation.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "topology.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief Read the NUMA node of the CPU.
+ * Linux links every CPU to its node as /sys/devices/system/cpu/cpuN/nodeM.
+ * @param[in] cpu – id of the CPU;
+ * @return Node of the CPU, @p 0 if it is unknown.
+ */
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0) {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/** @brief Compare two CPUs by their nodes, then by their ids.
+ * @param[in] a – first CPU and its node;
+ * @param[in] b – second CPU and its node;
+ * @return Negative, zero or positive value like strcmp.
+ */
+static int compare_cpus(const void* a, const void* b) {
+    const int* x = a;
+    const int* y = b;
+    if (x[1] != y[1]) {
+        return x[1] - y[1];
+    }
+    return x[0] - y[0];
+}
+
+int topology_init(topology_t* topology, const int* cpus, size_t count,
+                  thread_pool_placement_t placement) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "ERROR: sched_getaffinity failed\n");
+        return -1;
+    }
+
+    // Pairs (cpu, node) of the usable CPUs.
+    int (*usable)[2] = malloc(CPU_SETSIZE * sizeof(*usable));
+    if (usable == NULL) {
+        fprintf(stderr, "ERROR: topology malloc failed\n");
+        return -1;
+    }
+    size_t usable_count = 0;
+    if (cpus == NULL) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                usable[usable_count][0] = cpu;
+                usable[usable_count++][1] = cpu_node(cpu);
+            }
+        }
+    } else {
+        for (size_t i = 0; i < count && usable_count < CPU_SETSIZE; ++i) {
+            if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE || !CPU_ISSET(cpus[i], &allowed)) {
+                fprintf(stderr, "ERROR: CPU %d can't be used\n", cpus[i]);
+                free(usable);
+                return -1;
+            }
+            usable[usable_count][0] = cpus[i];
+            usable[usable_count++][1] = cpu_node(cpus[i]);
+        }
+    }
+    if (usable_count == 0) {
+        fprintf(stderr, "ERROR: no CPU to place the threads on\n");
+        free(usable);
+        return -1;
+    }
+    qsort(usable, usable_count, sizeof(*usable), compare_cpus);
+
+    topology->cpus = malloc(usable_count * sizeof(int));
+    topology->nodes = malloc(usable_count * sizeof(int));
+    if (topology->cpus == NULL || topology->nodes == NULL) {
+        fprintf(stderr, "ERROR: topology malloc failed\n");
+        free(topology->cpus);
+        free(topology->nodes);
+        free(usable);
+        return -1;
+    }
+    topology->cpus_count = usable_count;
+
+    if (placement == THREAD_POOL_PLACEMENT_SPREAD) {
+        // Take the next unused CPU of every node in turn.
+        size_t taken = 0;
+        for (size_t round = 0; taken < usable_count; ++round) {
+            size_t index_in_node = 0;
+            for (size_t i = 0; i < usable_count; ++i) {
+                if (i > 0 && usable[i][1] != usable[i - 1][1]) {
+                    index_in_node = 0;
+                }
+                if (index_in_node++ == round) {
+                    topology->cpus[taken] = usable[i][0];
+                    topology->nodes[taken++] = usable[i][1];
+                }
+            }
+        }
+    } else {
+        for (size_t i = 0; i < usable_count; ++i) {
+            topology->cpus[i] = usable[i][0];
+            topology->nodes[i] = usable[i][1];
+        }
+    }
+
+    free(usable);
+    return 0;
+}
+
+void topology_destroy(topology_t* topology) {
+    free(topology->cpus);
+    free(topology->nodes);
+}
+
+int topology_pin(pthread_attr_t* attr, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_attr_setaffinity_np(attr, sizeof(set), &set) != 0) {
+        fprintf(stderr, "ERROR: pthread_attr_setaffinity_np failed\n");
+        return -1;
+    }
+    return 0;
+}
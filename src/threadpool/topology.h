@@ -0,0 +1,54 @@
+/** @file
+ * CPU and NUMA topology header file.
+ *
+ * @author Michał Niedziółka <michal.niedziolka@students.mimuw.edu.pl>
+ * @copyright Michał Niedziółka
+ * @date 18.10.2026
+ */
+
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "threadpool.h"
+
+/**
+ * CPUs the threads are placed on, in the order of the threads.
+ */
+typedef struct topology {
+    size_t cpus_count; ///<   number of the CPUs;
+    int* cpus; ///<            ids of the CPUs;
+    int* nodes; ///< NUMA node of every CPU;
+} topology_t;
+
+/** @brief Read the CPUs the threads may run on and order them.
+ * The CPUs are the requested ones, every one of which has to be allowed
+ * for the process, or all CPUs allowed for the process. Nodes are read from /sys, a machine
+ * without NUMA information is a single node 0.
+ * @param[out] topology – pointer to the topology;
+ * @param[in] cpus      – requested CPUs, @p NULL for all allowed ones;
+ * @param[in] count     – number of the requested CPUs;
+ * @param[in] placement – order of the CPUs;
+ * @return @p 0, if init was finished correctly.
+ * Non-zero value, if no CPU can be used, a requested CPU does not exist
+ * or is not allowed for the process, or errors occurred.
+ */
+int topology_init(topology_t* topology, const int* cpus, size_t count,
+                  thread_pool_placement_t placement);
+
+/** @brief Deallocate the topology.
+ * @param[in,out] topology – pointer to the topology;
+ */
+void topology_destroy(topology_t* topology);
+
+/** @brief Pin threads created with the attribute to the CPU.
+ * @param[in,out] attr – attribute of the new thread;
+ * @param[in] cpu      –               id of the CPU;
+ * @return @p 0, if the affinity was set correctly.
+ * Non-zero value, if errors occurred.
+ */
+int topology_pin(pthread_attr_t* attr, int cpu);
+
+#endif // __TOPOLOGY_H__
@@ -1,8 +1,14 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "src/future/future.h"
+#include "src/threadpool/futex.h"
 #include "minunit.h"
 
 int tests_run = 0;
@@ -132,11 +138,504 @@ static char *test_map_simple3() {
     return 0;
 }
 
+static char *test_async_batch() {
+    thread_pool_init(&pool, 3);
+
+    enum { COUNT = 100 };
+    future_t futures[COUNT];
+    callable_t callables[COUNT];
+    int args[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        args[i] = i;
+        callables[i] = (callable_t) {.function = squared, .arg = &args[i], .argsz = sizeof(int)};
+    }
+    mu_assert("async_batch failed", async_batch(&pool, futures, callables, COUNT) == 0);
+
+    for (int i = 0; i < COUNT; ++i) {
+        int *m = await(&futures[i]);
+        mu_assert("expected i * i", *m == i * i);
+        free(m);
+    }
+
+    thread_pool_destroy(&pool);
+    return 0;
+}
+
+static void *wait_for_gate(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz __attribute__((unused))) {
+    sem_wait(arg);
+    int *ret = malloc(sizeof(int));
+    *ret = 2;
+    return ret;
+}
+
+static void open_gate(void *arg, size_t argsz __attribute__((unused))) {
+    sem_post(arg);
+}
+
+static char *test_async_batch_full_ring() {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, 1);
+    options.mode = THREAD_POOL_RING_BUFFER;
+    options.capacity = 2;
+    thread_pool_init_with(&pool, &options);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    async(&pool, &future,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+
+    // The gate task takes the thread or a cell, so at most 2 tasks fit.
+    enum { COUNT = 4 };
+    future_t futures[COUNT];
+    callable_t callables[COUNT];
+    int args[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        args[i] = i;
+        callables[i] = (callable_t) {.function = squared, .arg = &args[i], .argsz = sizeof(int)};
+    }
+    mu_assert("full ring should fail async_batch",
+              async_batch(&pool, futures, callables, COUNT) != 0);
+    mu_assert("futures of rejected tasks should be cancelled",
+              future_cancelled(&futures[COUNT - 2]) && future_cancelled(&futures[COUNT - 1]));
+    mu_assert("cancelled future should have no result", await(&futures[COUNT - 1]) == NULL);
+
+    sem_post(&gate);
+    free(await(&future));
+    for (int i = 0; i < COUNT; ++i) {
+        int *m = await(&futures[i]);
+        mu_assert("deferred tasks should run", future_cancelled(&futures[i]) || *m == i * i);
+        free(m);
+    }
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static char *test_map_does_not_block() {
+    thread_pool_t gate_pool;
+    thread_pool_init(&gate_pool, 1);
+    thread_pool_init(&pool, 1);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+
+    enum { DEPTH = 20 };
+    future_t tab[DEPTH + 1];
+    async(&gate_pool, &tab[0],
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+    for (int i = 1; i <= DEPTH; ++i) {
+        map(&pool, &tab[i], &tab[i - 1], i % 2 == 1 ? squared_free : div2_free);
+    }
+    // The only thread of the pool is not blocked by the chain of maps.
+    defer(&pool, (runnable_t) {.function = open_gate, .arg = &gate, .argsz = 0});
+
+    int *m = await(&tab[DEPTH]);
+    mu_assert("expected 2", *m == 2);
+    free(m);
+
+    thread_pool_destroy(&pool);
+    thread_pool_destroy(&gate_pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static char *test_map_ready() {
+    thread_pool_init(&pool, 2);
+
+    future_t ready, mapped;
+    int *n = malloc(sizeof(int));
+    *n = 7;
+    future_init_ready(&ready, n, sizeof(int));
+    map(&pool, &mapped, &ready, squared_free);
+
+    int *m = await(&mapped);
+    mu_assert("expected 49", *m == 49);
+    free(m);
+
+    thread_pool_destroy(&pool);
+    return 0;
+}
+
+static char *test_when_all() {
+    thread_pool_init(&pool, 3);
+
+    enum { COUNT = 20 };
+    future_t futures[COUNT];
+    future_t *inputs[COUNT];
+    int args[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        args[i] = i;
+        inputs[i] = &futures[i];
+        async(&pool, &futures[i],
+              (callable_t) {.function = squared, .arg = &args[i], .argsz = sizeof(int)});
+    }
+
+    future_t all;
+    when_all(&pool, &all, inputs, COUNT);
+    future_t **done = await(&all);
+    mu_assert("expected inputs", done == inputs);
+    mu_assert("expected count", all.result_size == COUNT);
+    for (int i = 0; i < COUNT; ++i) {
+        int *m = await(done[i]);
+        mu_assert("expected i * i", *m == i * i);
+        free(m);
+    }
+
+    thread_pool_destroy(&pool);
+    return 0;
+}
+
+static char *test_when_any() {
+    thread_pool_init(&pool, 2);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    future_t gated, ready;
+    async(&pool, &gated,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+    int *n = malloc(sizeof(int));
+    *n = 5;
+    future_init_ready(&ready, n, sizeof(int));
+
+    future_t *inputs[2] = {&gated, &ready};
+    future_t any;
+    when_any(&pool, &any, inputs, 2);
+    future_t *winner = await(&any);
+    mu_assert("expected the ready future", winner == &ready);
+    mu_assert("expected index 1", any.result_size == 1);
+
+    sem_post(&gate);
+    free(await(&gated));
+    free(n);
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static char *test_await_timeout() {
+    thread_pool_init(&pool, 1);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    async(&pool, &future,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+
+    void *result = NULL;
+    mu_assert("try_get should fail", !future_try_get(&future, &result));
+    mu_assert("expected timeout", await_for(&future, 1000000, &result) == ETIMEDOUT);
+
+    sem_post(&gate);
+    mu_assert("expected result", await_for(&future, 1000000000, &result) == 0);
+    mu_assert("expected 2", *(int *) result == 2);
+    mu_assert("try_get should succeed", future_try_get(&future, &result));
+    mu_assert("await should return the same result", await(&future) == result);
+    free(result);
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static void *await_shared(void *arg) {
+    return await(arg);
+}
+
+static char *test_shared_await() {
+    thread_pool_init(&pool, 1);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    async(&pool, &future,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+
+    enum { AWAITERS = 8 };
+    pthread_t awaiters[AWAITERS];
+    for (int i = 0; i < AWAITERS; ++i) {
+        pthread_create(&awaiters[i], NULL, await_shared, &future);
+    }
+    sem_post(&gate);
+
+    void *result = await(&future);
+    for (int i = 0; i < AWAITERS; ++i) {
+        void *other;
+        pthread_join(awaiters[i], &other);
+        mu_assert("every awaiter should get the same result", other == result);
+    }
+    mu_assert("await should not consume the future", await(&future) == result);
+    mu_assert("expected 2", *(int *) result == 2);
+    free(result);
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static atomic_int called;
+
+static void *count_call(void *arg, size_t argsz __attribute__((unused)),
+                        size_t *retsz __attribute__((unused))) {
+    atomic_fetch_add(&called, 1);
+    return arg;
+}
+
+static void *wait_for_cancel(void *arg, size_t argsz __attribute__((unused)),
+                             size_t *retsz __attribute__((unused))) {
+    cancel_token_t *token = arg;
+    while (!cancel_requested(token)) {
+        sched_yield();
+    }
+    return NULL;
+}
+
+static char *test_cancel_queued() {
+    thread_pool_init(&pool, 1);
+    atomic_store(&called, 0);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    future_t gated;
+    async(&pool, &gated,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+
+    // Both wait behind the gate, so they are cancelled before they start.
+    int n = 3;
+    async(&pool, &future,
+          (callable_t) {.function = count_call, .arg = &n, .argsz = sizeof(int)});
+    future_t chain[3];
+    map(&pool, &chain[0], &future, count_call);
+    for (int i = 1; i < 3; ++i) {
+        map(&pool, &chain[i], &chain[i - 1], count_call);
+    }
+    future_cancel(&future);
+    sem_post(&gate);
+
+    void *result = &n;
+    mu_assert("expected ECANCELED", await_for(&future, 1000000000, &result) == ECANCELED);
+    mu_assert("cancelled future has no result", result == NULL);
+    mu_assert("future should be cancelled", future_cancelled(&future));
+    for (int i = 0; i < 3; ++i) {
+        mu_assert("mapped future should be cancelled", await(&chain[i]) == NULL);
+        mu_assert("mapped future should be cancelled", future_cancelled(&chain[i]));
+    }
+    mu_assert("cancelled functions should not be called", atomic_load(&called) == 0);
+    free(await(&gated));
+    mu_assert("other futures should not be cancelled", !future_cancelled(&gated));
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&gate);
+    return 0;
+}
+
+static char *test_cancel_running() {
+    thread_pool_init(&pool, 2);
+
+    cancel_token_t token;
+    cancel_token_init(&token);
+    async(&pool, &future,
+          (callable_t) {.function = wait_for_cancel, .arg = &token, .argsz = 0,
+                        .token = &token});
+    future_t mapped, all;
+    map(&pool, &mapped, &future, count_call);
+    future_t *inputs[1] = {&future};
+    when_all(&pool, &all, inputs, 1);
+
+    void *result;
+    mu_assert("expected timeout", await_for(&future, 1000000, &result) == ETIMEDOUT);
+    cancel(&token);
+    await(&future);
+    mu_assert("polling future should be cancelled", future_cancelled(&future));
+    await(&mapped);
+    mu_assert("mapped future should be cancelled", future_cancelled(&mapped));
+    await(&all);
+    mu_assert("when_all of a cancelled future should be cancelled", future_cancelled(&all));
+
+    thread_pool_destroy(&pool);
+    return 0;
+}
+
+static void count_run(void *arg, size_t argsz __attribute__((unused))) {
+    atomic_fetch_add((atomic_int *) arg, 1);
+}
+
+static char *test_cancel_deferred() {
+    thread_pool_init(&pool, 1);
+
+    sem_t gate;
+    sem_init(&gate, 0, 0);
+    future_t gated;
+    async(&pool, &gated,
+          (callable_t) {.function = wait_for_gate, .arg = &gate, .argsz = sizeof(sem_t)});
+
+    enum { COUNT = 10 };
+    atomic_int runs;
+    atomic_init(&runs, 0);
+    cancel_token_t token;
+    cancel_token_init(&token);
+    for (int i = 0; i < COUNT; ++i) {
+        defer(&pool, (runnable_t) {.function = count_run, .arg = &runs, .argsz = 0,
+                                   .token = i % 2 == 0 ? &token : NULL});
+    }
+    defer_every(&pool, (runnable_t) {.function = count_run, .arg = &runs, .argsz = 0,
+                                     .token = &token}, 1000000);
+    cancel(&token);
+    sem_post(&gate);
+    free(await(&gated));
+    thread_pool_destroy(&pool);
+
+    mu_assert("only tasks without the token should run", atomic_load(&runs) == COUNT / 2);
+    sem_destroy(&gate);
+    return 0;
+}
+
+typedef struct fib_args {
+    thread_pool_t *pool;
+    int n;
+} fib_args_t;
+
+// Awaits its subproblems inside the pool, so it needs helping awaiters.
+static void *fib(void *arg, size_t argsz __attribute__((unused)),
+                 size_t *retsz __attribute__((unused))) {
+    fib_args_t *args = arg;
+    long *ret = malloc(sizeof(long));
+    if (args->n < 2) {
+        *ret = args->n;
+        return ret;
+    }
+    fib_args_t sub[2] = {{args->pool, args->n - 1}, {args->pool, args->n - 2}};
+    future_t futures[2];
+    for (int i = 0; i < 2; ++i) {
+        async(args->pool, &futures[i],
+              (callable_t) {.function = fib, .arg = &sub[i], .argsz = sizeof(fib_args_t)});
+    }
+    *ret = 0;
+    for (int i = 0; i < 2; ++i) {
+        long *part = await(&futures[i]);
+        *ret += *part;
+        free(part);
+    }
+    return ret;
+}
+
+static char *test_await_helps() {
+    for (int mode = 0; mode < 3; ++mode) {
+        thread_pool_options_t options;
+        thread_pool_options_init(&options, 1);
+        options.mode = mode;
+        mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+        // A single thread would wait for itself if await blocked it.
+        fib_args_t args = {&pool, 12};
+        async(&pool, &future,
+              (callable_t) {.function = fib, .arg = &args, .argsz = sizeof(fib_args_t)});
+        long *m = await(&future);
+        mu_assert("expected fib(12) = 144", *m == 144);
+        free(m);
+
+        thread_pool_destroy(&pool);
+    }
+    return 0;
+}
+
+static void *fill_ring(void *arg, size_t argsz __attribute__((unused)),
+                       size_t *retsz __attribute__((unused))) {
+    // Both cells of the ring are taken when the mapped task is deferred.
+    for (int i = 0; i < 2; ++i) {
+        defer(&pool, (runnable_t) {.function = count_run, .arg = arg, .argsz = 0});
+    }
+    int *ret = malloc(sizeof(int));
+    *ret = 3;
+    return ret;
+}
+
+static char *test_map_full_ring() {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, 1);
+    options.mode = THREAD_POOL_RING_BUFFER;
+    options.capacity = 2;
+    thread_pool_init_with(&pool, &options);
+    atomic_store(&called, 0);
+
+    future_t mapped;
+    async(&pool, &future, (callable_t) {.function = fill_ring, .arg = &called, .argsz = 0});
+    map(&pool, &mapped, &future, squared_free);
+    void *result = NULL;
+    mu_assert("mapped future should finish", await_for(&mapped, 1000000000, &result) == 0);
+    mu_assert("expected 9", *(int *) result == 9);
+    free(result);
+
+    thread_pool_destroy(&pool);
+    mu_assert("tasks in the ring should run", atomic_load(&called) == 2);
+    return 0;
+}
+
+static void *count_mapped(void *arg __attribute__((unused)),
+                          size_t argsz __attribute__((unused)),
+                          size_t *retsz __attribute__((unused))) {
+    atomic_fetch_add(&called, 1);
+    return NULL;
+}
+
+// Sets the final state of the source, like the end of complete().
+static void *cancel_source(void *arg) {
+    future_t *from = arg;
+    usleep(10000);
+    if (atomic_exchange(&from->state, FUTURE_CANCELLED) == FUTURE_WAITED) {
+        futex_wake(&from->state, INT_MAX);
+    }
+    return NULL;
+}
+
+static char *test_continue_completing() {
+    thread_pool_init(&pool, 1);
+    atomic_store(&called, 0);
+    for (int i = 0; i < 2; ++i) {
+        // The list of continuations is already taken, the state not yet set.
+        future_t from;
+        future_init_ready(&from, NULL, 0);
+        atomic_store(&from.state, FUTURE_PENDING);
+        pthread_t thread;
+        pthread_create(&thread, NULL, cancel_source, &from);
+
+        future_t to;
+        future_t *inputs[1] = {&from};
+        if (i == 0) {
+            map(&pool, &to, &from, count_mapped);
+        } else {
+            when_all(&pool, &to, inputs, 1);
+        }
+        await(&to);
+        pthread_join(thread, NULL);
+        mu_assert("future depending on a cancelled one should be cancelled",
+                  future_cancelled(&to));
+    }
+    thread_pool_destroy(&pool);
+    mu_assert("mapped function of a cancelled future should not run",
+              atomic_load(&called) == 0);
+    return 0;
+}
+
 static char *all_tests() {
     mu_run_test(test_await_simple);
     mu_run_test(test_map_simple);
     mu_run_test(test_map_simple2);
     mu_run_test(test_map_simple3);
+    mu_run_test(test_async_batch);
+    mu_run_test(test_async_batch_full_ring);
+    mu_run_test(test_map_does_not_block);
+    mu_run_test(test_map_ready);
+    mu_run_test(test_when_all);
+    mu_run_test(test_when_any);
+    mu_run_test(test_await_timeout);
+    mu_run_test(test_shared_await);
+    mu_run_test(test_cancel_queued);
+    mu_run_test(test_cancel_running);
+    mu_run_test(test_cancel_deferred);
+    mu_run_test(test_await_helps);
+    mu_run_test(test_map_full_ring);
+    mu_run_test(test_continue_completing);
     return 0;
 }
 
@@ -1,9 +1,18 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "minunit.h"
+#include "src/threadpool/graph.h"
+#include "src/threadpool/group.h"
+#include "src/threadpool/parallel.h"
 #include "src/threadpool/threadpool.h"
 
 int tests_run = 0;
@@ -50,8 +59,1186 @@ static char *ping_pong() {
   return 0;
 }
 
+#define TREE_DEPTH 10
+#define TREE_ROOTS 4
+#define TREE_NODES (TREE_ROOTS * ((1 << (TREE_DEPTH + 1)) - 1))
+
+typedef struct tree_context {
+  thread_pool_t *pool;
+  atomic_int visited;
+  sem_t done;
+} tree_context_t;
+
+// Depth of the subtree is passed as argsz.
+static void visit_tree(void *args, size_t depth) {
+  tree_context_t *context = args;
+  if (depth > 0) {
+    defer(context->pool, (runnable_t){.function = visit_tree,
+                                      .arg = context,
+                                      .argsz = depth - 1});
+    defer(context->pool, (runnable_t){.function = visit_tree,
+                                      .arg = context,
+                                      .argsz = depth - 1});
+  }
+  if (atomic_fetch_add(&context->visited, 1) + 1 == TREE_NODES) {
+    sem_post(&context->done);
+  }
+}
+
+static char *visit_trees(thread_pool_mode_t mode, size_t pool_size) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, pool_size);
+  options.mode = mode;
+  options.capacity = 2 * TREE_NODES;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+  tree_context_t context = {.pool = &pool};
+  atomic_init(&context.visited, 0);
+  sem_init(&context.done, 0, 0);
+
+  for (int i = 0; i < TREE_ROOTS; ++i) {
+    defer(&pool, (runnable_t){.function = visit_tree,
+                              .arg = &context,
+                              .argsz = TREE_DEPTH});
+  }
+  sem_wait(&context.done);
+  thread_pool_destroy(&pool);
+
+  mu_assert("not every node was visited",
+            atomic_load(&context.visited) == TREE_NODES);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static char *shared_queue_tree() {
+  return visit_trees(THREAD_POOL_SHARED_QUEUE, 4);
+}
+
+static char *work_stealing_tree() {
+  return visit_trees(THREAD_POOL_WORK_STEALING, 4);
+}
+
+static char *work_stealing_single() {
+  return visit_trees(THREAD_POOL_WORK_STEALING, 1);
+}
+
+static char *ring_buffer_tree() {
+  return visit_trees(THREAD_POOL_RING_BUFFER, 4);
+}
+
+static char *sharded_queues_tree() {
+  return visit_trees(THREAD_POOL_SHARDED_QUEUES, 4);
+}
+
+static void block_on(void *args, size_t argsz __attribute__((unused))) {
+  sem_t *started = args;
+  sem_t *release = (sem_t *)args + 1;
+  sem_post(started);
+  sem_wait(release);
+}
+
+static char *ring_buffer_full() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.mode = THREAD_POOL_RING_BUFFER;
+  options.capacity = 3; // rounded up to 4
+  thread_pool_init_with(&pool, &options);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  runnable_t blocker = {.function = block_on, .arg = sems, .argsz = 0};
+
+  defer(&pool, blocker);
+  sem_wait(&sems[0]);
+  for (int i = 0; i < 4; ++i) {
+    mu_assert("ring should accept 4 tasks", defer(&pool, blocker) == 0);
+  }
+  mu_assert("full ring should reject the task", defer(&pool, blocker) != 0);
+
+  for (int i = 0; i < 5; ++i) {
+    sem_post(&sems[1]);
+  }
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+static char *batch_of_trees(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 3);
+  options.mode = mode;
+  options.capacity = 2 * TREE_NODES;
+  thread_pool_init_with(&pool, &options);
+
+  tree_context_t context = {.pool = &pool};
+  atomic_init(&context.visited, 0);
+  sem_init(&context.done, 0, 0);
+
+  runnable_t roots[TREE_ROOTS];
+  for (int i = 0; i < TREE_ROOTS; ++i) {
+    roots[i] = (runnable_t){.function = visit_tree,
+                            .arg = &context,
+                            .argsz = TREE_DEPTH};
+  }
+  mu_assert("defer_batch failed", defer_batch(&pool, roots, TREE_ROOTS) == 0);
+  sem_wait(&context.done);
+  thread_pool_destroy(&pool);
+
+  mu_assert("not every node was visited",
+            atomic_load(&context.visited) == TREE_NODES);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static char *defer_batch_shared() {
+  return batch_of_trees(THREAD_POOL_SHARED_QUEUE);
+}
+
+static char *defer_batch_stealing() {
+  return batch_of_trees(THREAD_POOL_WORK_STEALING);
+}
+
+static char *defer_batch_ring() {
+  return batch_of_trees(THREAD_POOL_RING_BUFFER);
+}
+
+typedef struct inline_args {
+  atomic_int *sum;
+  sem_t *done;
+  int value;
+  char padding[THREAD_POOL_INLINE_ARGS - sizeof(atomic_int *) - sizeof(sem_t *) - sizeof(int)];
+} inline_args_t;
+
+static void add_inline(void *args, size_t argsz) {
+  inline_args_t *context = args;
+  if (argsz == sizeof(inline_args_t) && context->padding[0] == 'x' &&
+      context->padding[sizeof(context->padding) - 1] == 'y') {
+    atomic_fetch_add(context->sum, context->value);
+  }
+  sem_post(context->done);
+}
+
+static char *inline_arguments(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.mode = mode;
+  thread_pool_init_with(&pool, &options);
+
+  atomic_int sum;
+  atomic_init(&sum, 0);
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  enum { COUNT = 100 };
+  inline_args_t args[COUNT];
+  for (int i = 0; i < COUNT; ++i) {
+    args[i] = (inline_args_t){.sum = &sum, .done = &done, .value = i};
+    args[i].padding[0] = 'x';
+    args[i].padding[sizeof(args[i].padding) - 1] = 'y';
+  }
+
+  for (int i = 0; i < COUNT / 2; ++i) {
+    mu_assert("defer_inline failed",
+              defer_inline(&pool, add_inline, &args[i], sizeof(inline_args_t)) == 0);
+  }
+  mu_assert("defer_batch_inline failed",
+            defer_batch_inline(&pool, add_inline, &args[COUNT / 2],
+                               sizeof(inline_args_t), COUNT / 2) == 0);
+  // Arguments were copied, the originals may be overwritten.
+  for (int i = 0; i < COUNT; ++i) {
+    args[i].value = -1000;
+  }
+  for (int i = 0; i < COUNT; ++i) {
+    sem_wait(&done);
+  }
+  mu_assert("expected sum of 0..99", atomic_load(&sum) == COUNT * (COUNT - 1) / 2);
+
+  char too_big[THREAD_POOL_INLINE_ARGS + 1];
+  mu_assert("too big arguments should be rejected",
+            defer_inline(&pool, add_inline, too_big, sizeof(too_big)) != 0);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+static char *inline_shared() {
+  return inline_arguments(THREAD_POOL_SHARED_QUEUE);
+}
+
+static char *inline_stealing() {
+  return inline_arguments(THREAD_POOL_WORK_STEALING);
+}
+
+static char *inline_ring() {
+  return inline_arguments(THREAD_POOL_RING_BUFFER);
+}
+
+static char *destroy_finishes_tasks() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 3);
+  options.mode = THREAD_POOL_WORK_STEALING;
+  thread_pool_init_with(&pool, &options);
+
+  tree_context_t context = {.pool = &pool};
+  atomic_init(&context.visited, 0);
+  sem_init(&context.done, 0, 0);
+
+  for (int i = 0; i < 100; ++i) {
+    defer(&pool, (runnable_t){.function = visit_tree,
+                              .arg = &context,
+                              .argsz = 0});
+  }
+  thread_pool_destroy(&pool);
+
+  mu_assert("destroy did not finish the tasks",
+            atomic_load(&context.visited) == 100);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static void post_done(void *args, size_t argsz __attribute__((unused))) {
+  sem_post(args);
+}
+
+static char *steady_state_allocations() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  runnable_t task = {.function = post_done, .arg = &done, .argsz = 0};
+
+  defer(&pool, task);
+  sem_wait(&done);
+  size_t allocations = thread_pool_allocations(&pool);
+
+  for (int i = 0; i < 1000; ++i) {
+    defer(&pool, task);
+    sem_wait(&done);
+  }
+  mu_assert("defer allocated after warm-up",
+            thread_pool_allocations(&pool) == allocations);
+
+  sem_destroy(&done);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *work_stealing_allocations() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = THREAD_POOL_WORK_STEALING;
+  thread_pool_init_with(&pool, &options);
+
+  tree_context_t context = {.pool = &pool};
+  sem_init(&context.done, 0, 0);
+  size_t allocations = 0;
+
+  for (int round = 0; round < 3; ++round) {
+    atomic_init(&context.visited, 0);
+    for (int i = 0; i < TREE_ROOTS; ++i) {
+      defer(&pool, (runnable_t){.function = visit_tree,
+                                .arg = &context,
+                                .argsz = TREE_DEPTH});
+    }
+    sem_wait(&context.done);
+    if (round == 0) {
+      allocations = thread_pool_allocations(&pool);
+    }
+  }
+  mu_assert("work-stealing defer allocated after warm-up",
+            thread_pool_allocations(&pool) == allocations);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+typedef struct priority_log {
+  int order[14];
+  int count;
+} priority_log_t;
+
+static void log_priority(void *args, size_t argsz) {
+  priority_log_t *log = args;
+  log->order[log->count++] = (int)argsz;
+}
+
+static char *priorities() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  defer(&pool, (runnable_t){.function = block_on, .arg = sems, .argsz = 0});
+  sem_wait(&sems[0]);
+
+  priority_log_t log = {.count = 0};
+  for (int i = 0; i < 7; ++i) {
+    defer_prio(&pool,
+               (runnable_t){.function = log_priority,
+                            .arg = &log,
+                            .argsz = THREAD_POOL_PRIORITY_LOW},
+               THREAD_POOL_PRIORITY_LOW);
+  }
+  for (int i = 0; i < 7; ++i) {
+    defer_prio(&pool,
+               (runnable_t){.function = log_priority,
+                            .arg = &log,
+                            .argsz = THREAD_POOL_PRIORITY_HIGH},
+               THREAD_POOL_PRIORITY_HIGH);
+  }
+  mu_assert("unknown priority should be rejected",
+            defer_prio(&pool, (runnable_t){.function = log_priority},
+                       THREAD_POOL_PRIORITIES) != 0);
+  sem_post(&sems[1]);
+  thread_pool_destroy(&pool);
+
+  mu_assert("all tasks should run", log.count == 14);
+  for (int i = 0; i < 4; ++i) {
+    mu_assert("high priority should run first",
+              log.order[i] == THREAD_POOL_PRIORITY_HIGH);
+  }
+  int last_high = 0;
+  for (int i = 0; i < 14; ++i) {
+    if (log.order[i] == THREAD_POOL_PRIORITY_HIGH) {
+      last_high = i;
+    }
+  }
+  mu_assert("low priority should not starve",
+            log.order[4] == THREAD_POOL_PRIORITY_LOW && last_high > 4);
+
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+#define LOOP_SIZE 10000
+
+typedef struct loop_context {
+  atomic_int visits[LOOP_SIZE];
+  atomic_int calls;
+} loop_context_t;
+
+static void visit_range(void *ctx, size_t begin, size_t end) {
+  loop_context_t *context = ctx;
+  atomic_fetch_add(&context->calls, 1);
+  for (size_t i = begin; i < end; ++i) {
+    atomic_fetch_add(&context->visits[i], 1);
+  }
+}
+
+static char *check_loop(thread_pool_t *pool, size_t grain) {
+  static loop_context_t context;
+  for (int i = 0; i < LOOP_SIZE; ++i) {
+    atomic_init(&context.visits[i], 0);
+  }
+  atomic_init(&context.calls, 0);
+
+  mu_assert("parallel_for should succeed",
+            parallel_for(pool, 10, LOOP_SIZE, grain, visit_range, &context) ==
+                0);
+  for (int i = 0; i < LOOP_SIZE; ++i) {
+    mu_assert("every iteration should run exactly once",
+              atomic_load(&context.visits[i]) == (i >= 10));
+  }
+  if (grain > 0) {
+    mu_assert("chunks should have grain iterations",
+              atomic_load(&context.calls) ==
+                  (int)((LOOP_SIZE - 10 + grain - 1) / grain));
+  }
+  return 0;
+}
+
+typedef struct long_loop {
+  atomic_size_t iterations;
+  atomic_int calls;
+} long_loop_t;
+
+static void count_range(void *ctx, size_t begin, size_t end) {
+  long_loop_t *loop = ctx;
+  atomic_fetch_add(&loop->calls, 1);
+  atomic_fetch_add(&loop->iterations, end - begin);
+}
+
+typedef struct nested_loop {
+  thread_pool_t *pool;
+  char *message;
+  sem_t done;
+} nested_loop_t;
+
+static void run_nested_loop(void *args, size_t argsz __attribute__((unused))) {
+  nested_loop_t *nested = args;
+  nested->message = check_loop(nested->pool, 7);
+  sem_post(&nested->done);
+}
+
+static char *parallel_loops() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+  size_t grains[4] = {0, 1, 64, LOOP_SIZE};
+  for (int i = 0; i < 4; ++i) {
+    char *message = check_loop(&pool, grains[i]);
+    if (message != 0) {
+      return message;
+    }
+  }
+  // Loops ending near SIZE_MAX don't wrap around.
+  long_loop_t long_loop;
+  atomic_init(&long_loop.iterations, 0);
+  atomic_init(&long_loop.calls, 0);
+  mu_assert("parallel_for should succeed",
+            parallel_for(&pool, 0, SIZE_MAX, SIZE_MAX / 2, count_range,
+                         &long_loop) == 0);
+  mu_assert("every iteration should run exactly once",
+            atomic_load(&long_loop.iterations) == SIZE_MAX);
+  mu_assert("loop should have 3 chunks", atomic_load(&long_loop.calls) == 3);
+  thread_pool_destroy(&pool);
+
+  // The caller takes part in the loop, so it can't block the only thread.
+  thread_pool_init(&pool, 1);
+  nested_loop_t nested = {.pool = &pool};
+  sem_init(&nested.done, 0, 0);
+  defer(&pool, (runnable_t){.function = run_nested_loop, .arg = &nested});
+  sem_wait(&nested.done);
+  mu_assert("parallel_for inside a task failed", nested.message == 0);
+  thread_pool_destroy(&pool);
+  sem_destroy(&nested.done);
+  return 0;
+}
+
+typedef struct min_max {
+  size_t min;
+  size_t max;
+  size_t sum;
+} min_max_t;
+
+static void reduce_range(void *ctx __attribute__((unused)), size_t begin,
+                         size_t end, void *accumulator) {
+  min_max_t *value = accumulator;
+  for (size_t i = begin; i < end; ++i) {
+    size_t x = (i * 7919) % LOOP_SIZE;
+    value->min = x < value->min ? x : value->min;
+    value->max = x > value->max ? x : value->max;
+    value->sum += x;
+  }
+}
+
+static void combine_min_max(void *ctx __attribute__((unused)), void *into,
+                            const void *from) {
+  min_max_t *a = into;
+  const min_max_t *b = from;
+  a->min = b->min < a->min ? b->min : a->min;
+  a->max = b->max > a->max ? b->max : a->max;
+  a->sum += b->sum;
+}
+
+static char *parallel_reductions() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+
+  // 7919 is prime, so the values are a permutation of [0, LOOP_SIZE).
+  min_max_t identity = {.min = LOOP_SIZE, .max = 0, .sum = 0};
+  size_t grains[4] = {0, 1, 100, LOOP_SIZE};
+  for (int i = 0; i < 4; ++i) {
+    min_max_t result;
+    mu_assert("parallel_reduce should succeed",
+              parallel_reduce(&pool, 0, LOOP_SIZE, grains[i], &identity,
+                              sizeof(min_max_t), reduce_range,
+                              combine_min_max, NULL, &result) == 0);
+    mu_assert("wrong min", result.min == 0);
+    mu_assert("wrong max", result.max == LOOP_SIZE - 1);
+    mu_assert("wrong sum",
+              result.sum == (size_t)LOOP_SIZE * (LOOP_SIZE - 1) / 2);
+  }
+
+  min_max_t empty;
+  parallel_reduce(&pool, 5, 5, 0, &identity, sizeof(min_max_t), reduce_range,
+                  combine_min_max, NULL, &empty);
+  mu_assert("empty reduction should give the identity",
+            empty.min == LOOP_SIZE && empty.max == 0 && empty.sum == 0);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+typedef struct placement_context {
+  atomic_int on_cpu;
+  atomic_int runs;
+  int cpu;
+  sem_t done;
+} placement_context_t;
+
+static void record_cpu(void *args, size_t argsz __attribute__((unused))) {
+  placement_context_t *context = args;
+  if (sched_getcpu() == context->cpu) {
+    atomic_fetch_add(&context->on_cpu, 1);
+  }
+  if (atomic_fetch_add(&context->runs, 1) + 1 == 100) {
+    sem_post(&context->done);
+  }
+}
+
+static char *check_placement(thread_pool_mode_t mode,
+                             thread_pool_placement_t placement) {
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  int cpu = 0;
+  while (!CPU_ISSET(cpu, &allowed)) {
+    ++cpu;
+  }
+
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 3);
+  options.mode = mode;
+  options.placement = placement;
+  options.cpus = &cpu;
+  options.cpus_count = 1;
+  mu_assert("pinned pool should start", thread_pool_init_with(&pool, &options) == 0);
+
+  placement_context_t context = {.cpu = cpu};
+  atomic_init(&context.on_cpu, 0);
+  atomic_init(&context.runs, 0);
+  sem_init(&context.done, 0, 0);
+  for (int i = 0; i < 100; ++i) {
+    defer(&pool, (runnable_t){.function = record_cpu, .arg = &context});
+  }
+  sem_wait(&context.done);
+  mu_assert("pinned threads should run on their CPU",
+            atomic_load(&context.on_cpu) == 100);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static char *placement() {
+  char *message = check_placement(THREAD_POOL_SHARED_QUEUE,
+                                  THREAD_POOL_PLACEMENT_COMPACT);
+  if (message != 0) {
+    return message;
+  }
+  message = check_placement(THREAD_POOL_WORK_STEALING,
+                            THREAD_POOL_PLACEMENT_SPREAD);
+  if (message != 0) {
+    return message;
+  }
+
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 2);
+  options.placement = THREAD_POOL_PLACEMENT_SPREAD;
+  int missing = -1;
+  options.cpus = &missing;
+  options.cpus_count = 1;
+  mu_assert("pool without usable CPUs should not start",
+            thread_pool_init_with(&pool, &options) != 0);
+
+  // One unusable CPU rejects the whole list.
+  cpu_set_t allowed;
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  int cpus[2] = {0, CPU_SETSIZE};
+  while (!CPU_ISSET(cpus[0], &allowed)) {
+    ++cpus[0];
+  }
+  options.cpus = cpus;
+  options.cpus_count = 2;
+  mu_assert("pool with an unusable CPU should not start",
+            thread_pool_init_with(&pool, &options) != 0);
+  return 0;
+}
+
+static char *check_stats(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = mode;
+  options.capacity = 2 * TREE_NODES;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+  tree_context_t context = {.pool = &pool};
+  atomic_init(&context.visited, 0);
+  sem_init(&context.done, 0, 0);
+  for (int i = 0; i < TREE_ROOTS; ++i) {
+    defer(&pool, (runnable_t){.function = visit_tree,
+                              .arg = &context,
+                              .argsz = TREE_DEPTH});
+  }
+  sem_wait(&context.done);
+
+  // The last task is counted after it returns.
+  thread_pool_stats_t stats;
+  thread_pool_stats(&pool, &stats);
+  for (int i = 0; i < 100 && stats.executed < TREE_NODES; ++i) {
+    usleep(1000);
+    thread_pool_stats(&pool, &stats);
+  }
+  mu_assert("every deferred task should be counted", stats.submitted == TREE_NODES);
+  mu_assert("every run task should be counted", stats.executed == TREE_NODES);
+  mu_assert("queue depth should be recorded", stats.max_queue_depth > 0);
+  mu_assert("ring buffer pools don't steal",
+            mode != THREAD_POOL_RING_BUFFER || stats.steals == 0);
+
+  uint64_t waits = 0;
+  uint64_t runs = 0;
+  for (int i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; ++i) {
+    waits += stats.wait_histogram[i];
+    runs += stats.run_histogram[i];
+  }
+  mu_assert("every task should have its wait time", waits == TREE_NODES);
+  mu_assert("every task should have its run time", runs == TREE_NODES);
+
+  uint64_t executed = 0;
+  thread_pool_stats_t worker;
+  for (size_t i = 0; i < 4; ++i) {
+    mu_assert("worker stats should be readable",
+              thread_pool_worker_stats(&pool, i, &worker) == 0);
+    executed += worker.executed;
+  }
+  mu_assert("workers should sum up to the pool", executed == stats.executed);
+  mu_assert("there are only 4 workers",
+            thread_pool_worker_stats(&pool, 4, &worker) != 0);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static char *pool_stats() {
+  char *message = check_stats(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_stats(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  message = check_stats(THREAD_POOL_RING_BUFFER);
+  if (message != 0) {
+    return message;
+  }
+  message = check_stats(THREAD_POOL_SHARDED_QUEUES);
+  if (message != 0) {
+    return message;
+  }
+
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.timing = false;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+  sem_t done;
+  sem_init(&done, 0, 0);
+  defer(&pool, (runnable_t){.function = post_done, .arg = &done, .argsz = 0});
+  sem_wait(&done);
+  thread_pool_stats_t stats;
+  thread_pool_stats(&pool, &stats);
+  for (int i = 0; i < 100 && stats.executed < 1; ++i) {
+    usleep(1000);
+    thread_pool_stats(&pool, &stats);
+  }
+  mu_assert("untimed tasks should be counted", stats.executed == 1);
+  for (int i = 0; i < THREAD_POOL_HISTOGRAM_BUCKETS; ++i) {
+    mu_assert("untimed tasks should not be in the histograms",
+              stats.wait_histogram[i] == 0 && stats.run_histogram[i] == 0);
+  }
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+#define GROUP_TASKS 10000
+
+static void count_member(void *args, size_t argsz __attribute__((unused))) {
+  atomic_fetch_add((atomic_int *)args, 1);
+}
+
+typedef struct group_tree {
+  task_group_t *group;
+  atomic_int visited;
+} group_tree_t;
+
+// Depth of the subtree is passed as argsz.
+static void visit_group_tree(void *args, size_t depth) {
+  group_tree_t *tree = args;
+  if (depth > 0) {
+    for (int i = 0; i < 2; ++i) {
+      task_group_defer(tree->group, (runnable_t){.function = visit_group_tree,
+                                                 .arg = tree,
+                                                 .argsz = depth - 1});
+    }
+  }
+  atomic_fetch_add(&tree->visited, 1);
+}
+
+typedef struct nested_group {
+  thread_pool_t *pool;
+  atomic_int visited;
+  sem_t done;
+} nested_group_t;
+
+// Waits for its own group inside the only thread of the pool.
+static void wait_nested_group(void *args, size_t argsz __attribute__((unused))) {
+  nested_group_t *nested = args;
+  task_group_t group;
+  task_group_init(&group, nested->pool);
+  for (int i = 0; i < 100; ++i) {
+    task_group_defer(&group, (runnable_t){.function = count_member,
+                                          .arg = &nested->visited,
+                                          .argsz = 0});
+  }
+  task_group_wait(&group);
+  sem_post(&nested->done);
+}
+
+static char *check_group(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = mode;
+  options.capacity = 2 * GROUP_TASKS;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+  task_group_t group;
+  task_group_init(&group, &pool);
+  atomic_int runs;
+  atomic_init(&runs, 0);
+  cancel_token_t token;
+  cancel_token_init(&token);
+  cancel(&token);
+  for (int round = 1; round <= 2; ++round) {
+    for (int i = 0; i < GROUP_TASKS; ++i) {
+      task_group_defer(&group, (runnable_t){.function = count_member,
+                                            .arg = &runs,
+                                            .argsz = 0});
+    }
+    // Cancelled tasks are not run, but the wait does not hang on them.
+    task_group_defer(&group, (runnable_t){.function = count_member,
+                                          .arg = &runs,
+                                          .argsz = 0,
+                                          .token = &token});
+    task_group_wait(&group);
+    mu_assert("group should wait for every task", atomic_load(&runs) == round * GROUP_TASKS);
+  }
+
+  group_tree_t tree = {.group = &group};
+  atomic_init(&tree.visited, 0);
+  task_group_defer(&group, (runnable_t){.function = visit_group_tree,
+                                        .arg = &tree,
+                                        .argsz = TREE_DEPTH});
+  task_group_wait(&group);
+  mu_assert("group should wait for tasks added by its tasks",
+            atomic_load(&tree.visited) == (1 << (TREE_DEPTH + 1)) - 1);
+  thread_pool_destroy(&pool);
+
+  options.pool_size = 1;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+  nested_group_t nested = {.pool = &pool};
+  atomic_init(&nested.visited, 0);
+  sem_init(&nested.done, 0, 0);
+  defer(&pool, (runnable_t){.function = wait_nested_group, .arg = &nested, .argsz = 0});
+  sem_wait(&nested.done);
+  mu_assert("nested group should finish on a single thread",
+            atomic_load(&nested.visited) == 100);
+  thread_pool_destroy(&pool);
+  sem_destroy(&nested.done);
+  return 0;
+}
+
+static char *task_groups() {
+  char *message = check_group(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_group(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  return check_group(THREAD_POOL_RING_BUFFER);
+}
+
+#define GRID_LAYERS 50
+#define GRID_WIDTH 20
+#define GRID_NODES (GRID_LAYERS * GRID_WIDTH)
+
+typedef struct graph_log {
+  atomic_int clock;
+  int stamps[GRID_NODES];
+} graph_log_t;
+
+// Index of the node is passed as argsz.
+static void stamp_node(void *args, size_t node) {
+  graph_log_t *log = args;
+  log->stamps[node] = atomic_fetch_add(&log->clock, 1);
+}
+
+static char *check_graph(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = mode;
+  options.capacity = 2 * GRID_NODES;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+  // Every node of a layer waits for two nodes of the previous one.
+  graph_log_t log;
+  task_graph_t graph;
+  task_graph_init(&graph);
+  for (size_t i = 0; i < GRID_NODES; ++i) {
+    size_t node;
+    mu_assert("add failed",
+              task_graph_add(&graph,
+                             (runnable_t){.function = stamp_node, .arg = &log, .argsz = i},
+                             1, &node) == 0 && node == i);
+  }
+  for (size_t layer = 1; layer < GRID_LAYERS; ++layer) {
+    for (size_t i = 0; i < GRID_WIDTH; ++i) {
+      size_t to = layer * GRID_WIDTH + i;
+      mu_assert("edge failed", task_graph_edge(&graph, to - GRID_WIDTH, to) == 0);
+      mu_assert("edge failed",
+                task_graph_edge(&graph, (layer - 1) * GRID_WIDTH + (i + 1) % GRID_WIDTH, to) == 0);
+    }
+  }
+  for (int run = 0; run < 2; ++run) {
+    atomic_init(&log.clock, 0);
+    mu_assert("run failed", task_graph_run(&graph, &pool) == 0);
+    task_graph_wait(&graph);
+    mu_assert("every node should run", atomic_load(&log.clock) == GRID_NODES);
+    for (size_t to = GRID_WIDTH; to < GRID_NODES; ++to) {
+      size_t layer = to / GRID_WIDTH;
+      mu_assert("node should run after its predecessors",
+                log.stamps[to] > log.stamps[to - GRID_WIDTH]
+                    && log.stamps[to] > log.stamps[(layer - 1) * GRID_WIDTH + (to + 1) % GRID_WIDTH]);
+    }
+  }
+  task_graph_destroy(&graph);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *task_graphs() {
+  char *message = check_graph(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_graph(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  message = check_graph(THREAD_POOL_RING_BUFFER);
+  if (message != 0) {
+    return message;
+  }
+
+  task_graph_t graph;
+  task_graph_init(&graph);
+  thread_pool_t pool;
+  mu_assert("init failed", thread_pool_init(&pool, 1) == 0);
+  mu_assert("empty graph should run", task_graph_run(&graph, &pool) == 0);
+  task_graph_wait(&graph);
+
+  // R -> A -> A2 -> A3 and R -> B: the longer path goes first on a single thread.
+  graph_log_t log;
+  atomic_init(&log.clock, 0);
+  size_t nodes[5];
+  for (size_t i = 0; i < 5; ++i) {
+    task_graph_add(&graph, (runnable_t){.function = stamp_node, .arg = &log, .argsz = i}, 1,
+                   &nodes[i]);
+  }
+  task_graph_edge(&graph, nodes[0], nodes[4]);
+  task_graph_edge(&graph, nodes[0], nodes[1]);
+  task_graph_edge(&graph, nodes[1], nodes[2]);
+  task_graph_edge(&graph, nodes[2], nodes[3]);
+  mu_assert("run failed", task_graph_run(&graph, &pool) == 0);
+  task_graph_wait(&graph);
+  for (int i = 0; i < 5; ++i) {
+    mu_assert("critical path should run first", log.stamps[i] == i);
+  }
+
+  mu_assert("unknown node should be rejected", task_graph_edge(&graph, 0, 5) != 0);
+  task_graph_edge(&graph, nodes[3], nodes[1]);
+  mu_assert("cycle should be rejected", task_graph_run(&graph, &pool) != 0);
+  task_graph_destroy(&graph);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+typedef struct lifo_context {
+  thread_pool_t *pool;
+  atomic_int clock;
+  int stamps[2];
+  sem_t child_done;
+  sem_t done;
+} lifo_context_t;
+
+// Index of the child is passed as argsz.
+static void stamp_child(void *args, size_t child) {
+  lifo_context_t *context = args;
+  context->stamps[child] = atomic_fetch_add(&context->clock, 1);
+  sem_post(&context->child_done);
+}
+
+static void spawn_children(void *args, size_t argsz __attribute__((unused))) {
+  lifo_context_t *context = args;
+  for (size_t i = 0; i < 2; ++i) {
+    defer(context->pool, (runnable_t){.function = stamp_child, .arg = context, .argsz = i});
+  }
+  sem_post(&context->done);
+}
+
+// Blocks its thread until the child in its slot is run by another thread.
+static void wait_for_child(void *args, size_t argsz __attribute__((unused))) {
+  lifo_context_t *context = args;
+  defer(context->pool, (runnable_t){.function = stamp_child, .arg = context, .argsz = 0});
+  sem_wait(&context->child_done);
+  sem_post(&context->done);
+}
+
+static char *lifo_slot() {
+  thread_pool_t pool;
+  lifo_context_t context = {.pool = &pool};
+  atomic_init(&context.clock, 0);
+  sem_init(&context.child_done, 0, 0);
+  sem_init(&context.done, 0, 0);
+
+  // The newest task spawned inside the pool runs first.
+  mu_assert("init failed", thread_pool_init(&pool, 1) == 0);
+  defer(&pool, (runnable_t){.function = spawn_children, .arg = &context, .argsz = 0});
+  sem_wait(&context.done);
+  sem_wait(&context.child_done);
+  sem_wait(&context.child_done);
+  mu_assert("newest task should run first", context.stamps[1] == 0 && context.stamps[0] == 1);
+  thread_pool_destroy(&pool);
+
+  // A task in the slot of a busy thread is taken by an idle one.
+  mu_assert("init failed", thread_pool_init(&pool, 2) == 0);
+  for (int i = 0; i < 10; ++i) {
+    defer(&pool, (runnable_t){.function = wait_for_child, .arg = &context, .argsz = 0});
+    sem_wait(&context.done);
+  }
+  thread_pool_destroy(&pool);
+  sem_destroy(&context.child_done);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+#define PRODUCERS 4
+#define PRODUCED_TASKS 5000
+
+typedef struct producer {
+  thread_pool_t *pool;
+  atomic_int *runs;
+} producer_t;
+
+static void *produce(void *args) {
+  producer_t *producer = args;
+  for (int i = 0; i < PRODUCED_TASKS; ++i) {
+    defer(producer->pool, (runnable_t){.function = count_member,
+                                       .arg = producer->runs,
+                                       .argsz = 0});
+  }
+  return NULL;
+}
+
+static char *sharded_producers() {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = THREAD_POOL_SHARDED_QUEUES;
+  options.shards = 3;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+  mu_assert("pool should have the requested shards", pool.shards_count == 3);
+
+  atomic_int runs;
+  atomic_init(&runs, 0);
+  producer_t producer = {.pool = &pool, .runs = &runs};
+  pthread_t producers[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; ++i) {
+    pthread_create(&producers[i], NULL, produce, &producer);
+  }
+  for (int i = 0; i < PRODUCERS; ++i) {
+    pthread_join(producers[i], NULL);
+  }
+  thread_pool_stats_t stats;
+  thread_pool_stats(&pool, &stats);
+  mu_assert("tasks of every shard should be counted",
+            stats.submitted == PRODUCERS * PRODUCED_TASKS);
+  // Every task deferred before destroy is run.
+  thread_pool_destroy(&pool);
+  mu_assert("every task from every producer should run",
+            atomic_load(&runs) == PRODUCERS * PRODUCED_TASKS);
+
+  thread_pool_options_init(&options, 2);
+  options.mode = THREAD_POOL_SHARDED_QUEUES;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+  mu_assert("pool should have a shard per thread", pool.shards_count == 2);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+typedef struct racing_producer {
+  thread_pool_t *pool;
+  atomic_int *runs;
+  atomic_int accepted;
+} racing_producer_t;
+
+// Defers until the pool is destroyed, counting the accepted tasks.
+static void *produce_until_destroyed(void *args) {
+  racing_producer_t *producer = args;
+  while (true) {
+    int err = defer(producer->pool, (runnable_t){.function = count_member,
+                                                 .arg = producer->runs,
+                                                 .argsz = 0});
+    if (err == 0) {
+      atomic_fetch_add(&producer->accepted, 1);
+    } else if (err != EAGAIN) {
+      return NULL;
+    }
+  }
+}
+
+static char *ring_destroy_race() {
+  for (int round = 0; round < 5; ++round) {
+    thread_pool_t pool;
+    thread_pool_options_t options;
+    thread_pool_options_init(&options, 2);
+    options.mode = THREAD_POOL_RING_BUFFER;
+    mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+    atomic_int runs;
+    atomic_init(&runs, 0);
+    racing_producer_t producer = {.pool = &pool, .runs = &runs};
+    atomic_init(&producer.accepted, 0);
+    pthread_t producers[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; ++i) {
+      pthread_create(&producers[i], NULL, produce_until_destroyed, &producer);
+    }
+    usleep(1000);
+    thread_pool_destroy(&pool);
+    for (int i = 0; i < PRODUCERS; ++i) {
+      pthread_join(producers[i], NULL);
+    }
+    mu_assert("every task accepted during destroy should run",
+              atomic_load(&runs) == atomic_load(&producer.accepted));
+  }
+  return 0;
+}
+
+#define CHAIN_LINKS 20000
+
+typedef struct respawn_chain {
+  thread_pool_t *pool;
+  atomic_int links;
+  atomic_int high_at;
+  sem_t started;
+  sem_t go;
+  sem_t done;
+} respawn_chain_t;
+
+// Number of links left is passed as argsz.
+static void respawn(void *args, size_t left) {
+  respawn_chain_t *chain = args;
+  if (atomic_fetch_add(&chain->links, 1) == 0) {
+    sem_post(&chain->started);
+    sem_wait(&chain->go);
+  }
+  if (left > 0) {
+    defer(chain->pool, (runnable_t){.function = respawn, .arg = chain, .argsz = left - 1});
+  } else {
+    sem_post(&chain->done);
+  }
+}
+
+static void mark_high(void *args, size_t argsz __attribute__((unused))) {
+  respawn_chain_t *chain = args;
+  atomic_store(&chain->high_at, atomic_load(&chain->links));
+}
+
+static char *check_respawn(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.mode = mode;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+  respawn_chain_t chain = {.pool = &pool};
+  atomic_init(&chain.links, 0);
+  atomic_init(&chain.high_at, -1);
+  sem_init(&chain.started, 0, 0);
+  sem_init(&chain.go, 0, 0);
+  sem_init(&chain.done, 0, 0);
+
+  defer(&pool, (runnable_t){.function = respawn, .arg = &chain, .argsz = CHAIN_LINKS});
+  sem_wait(&chain.started);
+  defer_prio(&pool, (runnable_t){.function = mark_high, .arg = &chain, .argsz = 0},
+             THREAD_POOL_PRIORITY_HIGH);
+  sem_post(&chain.go);
+  sem_wait(&chain.done);
+  thread_pool_destroy(&pool);
+
+  int high_at = atomic_load(&chain.high_at);
+  mu_assert("queued task should not wait for the whole chain",
+            high_at > 0 && high_at < CHAIN_LINKS / 10);
+  sem_destroy(&chain.started);
+  sem_destroy(&chain.go);
+  sem_destroy(&chain.done);
+  return 0;
+}
+
+static char *respawning_tasks() {
+  char *message = check_respawn(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_respawn(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  message = check_respawn(THREAD_POOL_RING_BUFFER);
+  if (message != 0) {
+    return message;
+  }
+  return check_respawn(THREAD_POOL_SHARDED_QUEUES);
+}
+
 static char *all_tests() {
   mu_run_test(ping_pong);
+  mu_run_test(shared_queue_tree);
+  mu_run_test(work_stealing_tree);
+  mu_run_test(work_stealing_single);
+  mu_run_test(ring_buffer_tree);
+  mu_run_test(sharded_queues_tree);
+  mu_run_test(ring_buffer_full);
+  mu_run_test(defer_batch_shared);
+  mu_run_test(defer_batch_stealing);
+  mu_run_test(defer_batch_ring);
+  mu_run_test(inline_shared);
+  mu_run_test(inline_stealing);
+  mu_run_test(inline_ring);
+  mu_run_test(destroy_finishes_tasks);
+  mu_run_test(steady_state_allocations);
+  mu_run_test(work_stealing_allocations);
+  mu_run_test(priorities);
+  mu_run_test(parallel_loops);
+  mu_run_test(parallel_reductions);
+  mu_run_test(placement);
+  mu_run_test(pool_stats);
+  mu_run_test(task_groups);
+  mu_run_test(task_graphs);
+  mu_run_test(lifo_slot);
+  mu_run_test(respawning_tasks);
+  mu_run_test(sharded_producers);
+  mu_run_test(ring_destroy_race);
   return 0;
 }
 
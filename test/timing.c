@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "minunit.h"
+#include "src/threadpool/threadpool.h"
+#include "src/threadpool/timer.h"
+
+// Tests that wait on the wall clock: timers, keepalive, spinning and
+// producers blocked on a bound.
+
+int tests_run = 0;
+
+#define TREE_DEPTH 10
+#define TREE_ROOTS 4
+#define TREE_NODES (TREE_ROOTS * ((1 << (TREE_DEPTH + 1)) - 1))
+
+typedef struct tree_context {
+  thread_pool_t *pool;
+  atomic_int visited;
+  sem_t done;
+} tree_context_t;
+
+// Depth of the subtree is passed as argsz.
+static void visit_tree(void *args, size_t depth) {
+  tree_context_t *context = args;
+  if (depth > 0) {
+    defer(context->pool, (runnable_t){.function = visit_tree,
+                                      .arg = context,
+                                      .argsz = depth - 1});
+    defer(context->pool, (runnable_t){.function = visit_tree,
+                                      .arg = context,
+                                      .argsz = depth - 1});
+  }
+  if (atomic_fetch_add(&context->visited, 1) + 1 == TREE_NODES) {
+    sem_post(&context->done);
+  }
+}
+
+static void block_on(void *args, size_t argsz __attribute__((unused))) {
+  sem_t *started = args;
+  sem_t *release = (sem_t *)args + 1;
+  sem_post(started);
+  sem_wait(release);
+}
+
+static void post_done(void *args, size_t argsz __attribute__((unused))) {
+  sem_post(args);
+}
+
+static void count_member(void *args, size_t argsz __attribute__((unused))) {
+  atomic_fetch_add((atomic_int *)args, 1);
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+typedef struct delayed_context {
+  uint64_t start;
+  uint64_t delay;
+  uint64_t ran;
+  atomic_int *order;
+  int position;
+} delayed_context_t;
+
+static void record_delayed(void *args, size_t argsz __attribute__((unused))) {
+  delayed_context_t *context = args;
+  context->ran = now_ns();
+  context->position = atomic_fetch_add(context->order, 1);
+}
+
+static char *delayed_tasks() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  // 70 ms is cascaded from the second level of the wheel.
+  uint64_t delays[3] = {70000000, 5000000, 30000000};
+  int expected[3] = {2, 0, 1};
+  atomic_int order = 0;
+  delayed_context_t contexts[3];
+  uint64_t start = now_ns();
+  for (int i = 0; i < 3; ++i) {
+    contexts[i] = (delayed_context_t){
+        .start = start, .delay = delays[i], .order = &order};
+    defer_after(&pool,
+                (runnable_t){.function = record_delayed,
+                             .arg = &contexts[i],
+                             .argsz = 0},
+                delays[i]);
+  }
+  // Destroy waits for the delayed tasks.
+  thread_pool_destroy(&pool);
+
+  mu_assert("all delayed tasks should run", atomic_load(&order) == 3);
+  for (int i = 0; i < 3; ++i) {
+    mu_assert("delayed task ran too early",
+              contexts[i].ran - contexts[i].start >= contexts[i].delay);
+    mu_assert("delayed tasks ran out of order",
+              contexts[i].position == expected[i]);
+  }
+  return 0;
+}
+
+typedef struct late_delay {
+  thread_pool_t *pool;
+  atomic_int runs;
+  int failures;
+} late_delay_t;
+
+// Adds itself again with a delay, until it has run 3 times.
+static void delay_again(void *args, size_t argsz __attribute__((unused))) {
+  late_delay_t *context = args;
+  if (atomic_fetch_add(&context->runs, 1) + 1 < 3 &&
+      defer_after(context->pool,
+                  (runnable_t){.function = delay_again, .arg = context},
+                  1000000) != 0) {
+    ++context->failures;
+  }
+}
+
+// Waits until the main thread is in destroy, then adds a delayed task.
+static void delay_during_destroy(void *args,
+                                 size_t argsz __attribute__((unused))) {
+  late_delay_t *context = args;
+  usleep(20000);
+  if (defer_after(context->pool,
+                  (runnable_t){.function = delay_again, .arg = context},
+                  1000000) != 0) {
+    ++context->failures;
+  }
+}
+
+static void ignore_drained(thread_pool_t *pool __attribute__((unused))) {}
+
+static char *delayed_during_destroy() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  late_delay_t context = {.pool = &pool, .failures = 0};
+  atomic_init(&context.runs, 0);
+  defer(&pool, (runnable_t){.function = delay_during_destroy, .arg = &context});
+  thread_pool_destroy(&pool);
+  mu_assert("running tasks should add delayed tasks during destroy",
+            context.failures == 0);
+  mu_assert("destroy should wait for delayed tasks of running tasks",
+            atomic_load(&context.runs) == 3);
+
+  // A delay past the end of the clock does not wrap around.
+  thread_pool_init(&pool, 1);
+  timer_wheel_t wheel;
+  timer_init(&wheel, &pool, ignore_drained);
+  mu_assert("huge delay should be accepted",
+            timer_add(&wheel, (runnable_t){.function = delay_again},
+                      UINT64_MAX, 0, false) == 0);
+  mu_assert("huge delay should not expire soon",
+            wheel.wakeup > wheel.current + 1000000);
+  timer_destroy(&wheel);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+typedef struct periodic_context {
+  atomic_int runs;
+  sem_t done;
+} periodic_context_t;
+
+static void count_periodic(void *args, size_t argsz __attribute__((unused))) {
+  periodic_context_t *context = args;
+  if (atomic_fetch_add(&context->runs, 1) + 1 == 5) {
+    sem_post(&context->done);
+  }
+}
+
+static char *periodic_tasks() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+
+  periodic_context_t context;
+  atomic_init(&context.runs, 0);
+  sem_init(&context.done, 0, 0);
+  uint64_t start = now_ns();
+  mu_assert("defer_every should succeed",
+            defer_every(&pool,
+                        (runnable_t){.function = count_periodic,
+                                     .arg = &context,
+                                     .argsz = 0},
+                        2000000) == 0);
+  mu_assert("zero period should be rejected",
+            defer_every(&pool, (runnable_t){.function = count_periodic}, 0) != 0);
+  sem_wait(&context.done);
+  mu_assert("periodic task ran too often", now_ns() - start >= 10000000);
+
+  // Destroy stops the periodic task.
+  thread_pool_destroy(&pool);
+  sem_destroy(&context.done);
+  return 0;
+}
+
+static char *check_elastic(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.mode = mode;
+  options.max_pool_size = 4;
+  options.keepalive_ns = 20000000;
+  mu_assert("elastic pool should start",
+            thread_pool_init_with(&pool, &options) == 0);
+  mu_assert("elastic pool should start with pool_size threads",
+            thread_pool_threads(&pool) == 1);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  runnable_t blocker = {.function = block_on, .arg = sems, .argsz = 0};
+  for (int round = 0; round < 2; ++round) {
+    // Every blocked task makes the pool grow, so all of them start.
+    for (int i = 0; i < 4; ++i) {
+      defer(&pool, blocker);
+    }
+    for (int i = 0; i < 4; ++i) {
+      sem_wait(&sems[0]);
+    }
+    mu_assert("elastic pool should grow to max_pool_size",
+              thread_pool_threads(&pool) == 4);
+    for (int i = 0; i < 4; ++i) {
+      sem_post(&sems[1]);
+    }
+
+    for (int i = 0; i < 100 && thread_pool_threads(&pool) > 1; ++i) {
+      usleep(10000);
+    }
+    mu_assert("idle threads should exit after the keepalive",
+              thread_pool_threads(&pool) == 1);
+  }
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+  return 0;
+}
+
+static char *elastic_pool() {
+  char *message = check_elastic(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_elastic(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  return check_elastic(THREAD_POOL_RING_BUFFER);
+}
+
+#define SPIN_ROUNDS 1000
+
+static char *check_spinning(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 4);
+  options.mode = mode;
+  options.capacity = 2 * TREE_NODES;
+  options.spin_count = 4096;
+  options.yield_count = 4;
+  mu_assert("spinning pool should start",
+            thread_pool_init_with(&pool, &options) == 0);
+
+  // Tasks submitted one by one are mostly taken by spinning threads.
+  sem_t done;
+  sem_init(&done, 0, 0);
+  for (int i = 0; i < SPIN_ROUNDS; ++i) {
+    defer(&pool, (runnable_t){.function = post_done, .arg = &done, .argsz = 0});
+    sem_wait(&done);
+  }
+
+  tree_context_t context = {.pool = &pool};
+  atomic_init(&context.visited, 0);
+  sem_init(&context.done, 0, 0);
+  for (int i = 0; i < TREE_ROOTS; ++i) {
+    defer(&pool, (runnable_t){.function = visit_tree,
+                              .arg = &context,
+                              .argsz = TREE_DEPTH});
+  }
+  sem_wait(&context.done);
+  thread_pool_destroy(&pool);
+
+  mu_assert("not every node was visited by spinning threads",
+            atomic_load(&context.visited) == TREE_NODES);
+  sem_destroy(&context.done);
+  sem_destroy(&done);
+  return 0;
+}
+
+static char *spinning_workers() {
+  char *message = check_spinning(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_spinning(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  return check_spinning(THREAD_POOL_RING_BUFFER);
+}
+
+typedef struct bounded_producer {
+  thread_pool_t *pool;
+  atomic_int *runs;
+  atomic_bool deferred;
+  int err;
+} bounded_producer_t;
+
+static void *defer_blocking(void *args) {
+  bounded_producer_t *producer = args;
+  defer(producer->pool, (runnable_t){.function = count_member,
+                                     .arg = producer->runs,
+                                     .argsz = 0});
+  atomic_store(&producer->deferred, true);
+  return NULL;
+}
+
+// Defers more tasks than the bound allows, from inside the pool.
+static void overfill(void *args, size_t argsz __attribute__((unused))) {
+  bounded_producer_t *producer = args;
+  for (int i = 0; i < 10; ++i) {
+    producer->err = defer(producer->pool, (runnable_t){.function = count_member,
+                                                       .arg = producer->runs,
+                                                       .argsz = 0});
+    if (producer->err != 0) {
+      return;
+    }
+  }
+  atomic_store(&producer->deferred, true);
+}
+
+static char *check_bounded(thread_pool_mode_t mode) {
+  thread_pool_t pool;
+  thread_pool_options_t options;
+  thread_pool_options_init(&options, 1);
+  options.mode = mode;
+  options.max_queued = 2;
+  mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+
+  sem_t sems[2];
+  sem_init(&sems[0], 0, 0);
+  sem_init(&sems[1], 0, 0);
+  atomic_int runs;
+  atomic_init(&runs, 0);
+  runnable_t counter = {.function = count_member, .arg = &runs, .argsz = 0};
+
+  defer(&pool, (runnable_t){.function = block_on, .arg = sems, .argsz = 0});
+  sem_wait(&sems[0]);
+  mu_assert("bounded pool should accept 2 tasks",
+            try_defer(&pool, counter) == 0 && try_defer(&pool, counter) == 0);
+  mu_assert("full pool should reject the task", try_defer(&pool, counter) == EAGAIN);
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += 10000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_nsec -= 1000000000;
+    ++deadline.tv_sec;
+  }
+  mu_assert("full pool should time out", defer_until(&pool, counter, &deadline) == ETIMEDOUT);
+
+  // defer waits until the blocked thread frees the space.
+  bounded_producer_t producer = {.pool = &pool, .runs = &runs};
+  atomic_init(&producer.deferred, false);
+  pthread_t thread;
+  pthread_create(&thread, NULL, defer_blocking, &producer);
+  usleep(10000);
+  mu_assert("defer should wait for space", !atomic_load(&producer.deferred));
+  sem_post(&sems[1]);
+  pthread_join(thread, NULL);
+
+  // Threads of the pool are never stopped by the bound.
+  atomic_store(&producer.deferred, false);
+  defer(&pool, (runnable_t){.function = overfill, .arg = &producer, .argsz = 0});
+  thread_pool_destroy(&pool);
+  mu_assert("tasks deferred inside the pool should be accepted",
+            atomic_load(&producer.deferred));
+  mu_assert("every accepted task should run", atomic_load(&runs) == 13);
+  sem_destroy(&sems[0]);
+  sem_destroy(&sems[1]);
+
+  // The ring can't grow, so it rejects tasks of the pool when it is full.
+  if (mode == THREAD_POOL_RING_BUFFER) {
+    options.capacity = 2;
+    mu_assert("init failed", thread_pool_init_with(&pool, &options) == 0);
+    atomic_store(&runs, 0);
+    atomic_store(&producer.deferred, false);
+    defer(&pool, (runnable_t){.function = overfill, .arg = &producer, .argsz = 0});
+    thread_pool_destroy(&pool);
+    mu_assert("full ring should reject tasks deferred inside the pool",
+              !atomic_load(&producer.deferred) && producer.err == EAGAIN);
+    mu_assert("every accepted task should run", atomic_load(&runs) == 2);
+  }
+  return 0;
+}
+
+static char *bounded_queues() {
+  char *message = check_bounded(THREAD_POOL_SHARED_QUEUE);
+  if (message != 0) {
+    return message;
+  }
+  message = check_bounded(THREAD_POOL_WORK_STEALING);
+  if (message != 0) {
+    return message;
+  }
+  message = check_bounded(THREAD_POOL_RING_BUFFER);
+  if (message != 0) {
+    return message;
+  }
+  return check_bounded(THREAD_POOL_SHARDED_QUEUES);
+}
+
+static char *all_tests() {
+  mu_run_test(delayed_tasks);
+  mu_run_test(delayed_during_destroy);
+  mu_run_test(periodic_tasks);
+  mu_run_test(elastic_pool);
+  mu_run_test(spinning_workers);
+  mu_run_test(bounded_queues);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ ": %s\n", result);
+  } else {
+    printf(__FILE__ ": ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ "Tests run: %d\n", tests_run);
+
+  return result != 0;
+}